@@ -0,0 +1,163 @@
+#pragma once
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <cstddef>
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#define CHECKSUMS_X86 1
+#else
+#define CHECKSUMS_X86 0
+#endif
+
+// Non-cryptographic checksums that can be computed from the same buffers as
+// a SHA digest. Each has the same update()/value() shape as the hashers.
+
+// CRC-32C (Castagnoli), as used by iSCSI, ext4 and most storage stacks.
+// SSE 4.2 has an instruction for it; elsewhere a table is used.
+class Crc32c
+{
+public:
+    void update(const unsigned char* p, size_t len)
+    {
+#if CHECKSUMS_X86
+        static const bool hardware = __builtin_cpu_supports("sse4.2");
+        if (hardware)
+        {
+            mCrc = updateHardware(mCrc, p, len);
+            return;
+        }
+#endif
+        static const std::array<uint32_t, 256> table = makeTable();
+        for (; len > 0; len--)
+            mCrc = table[(mCrc ^ *p++) & 0xff] ^ (mCrc >> 8);
+    }
+
+    uint32_t value() const { return ~mCrc; }
+
+private:
+    static std::array<uint32_t, 256> makeTable()
+    {
+        std::array<uint32_t, 256> table = {};
+        for (uint32_t i = 0; i < 256; i++)
+        {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++)
+                c = (c & 1) ? (c >> 1) ^ 0x82f63b78 : c >> 1;
+            table[i] = c;
+        }
+        return table;
+    }
+
+#if CHECKSUMS_X86
+    __attribute__((target("sse4.2")))
+    static uint32_t updateHardware(uint32_t crc, const unsigned char* p, size_t len)
+    {
+#if defined(__x86_64__)
+        uint64_t crc64 = crc;
+        for (; len >= 8; len -= 8, p += 8)
+        {
+            uint64_t v;
+            std::memcpy(&v, p, 8);
+            crc64 = _mm_crc32_u64(crc64, v);
+        }
+        crc = static_cast<uint32_t>(crc64);
+#endif
+        for (; len > 0; len--)
+            crc = _mm_crc32_u8(crc, *p++);
+        return crc;
+    }
+#endif
+
+    uint32_t mCrc = 0xffffffff;
+};
+
+// XXH64, Yann Collet's xxHash with 64 bit output and a seed of zero.
+class Xxh64
+{
+public:
+    void update(const unsigned char* p, size_t len)
+    {
+        mLength += len;
+
+        if (mBuffered > 0)
+        {
+            const size_t n = len < 32 - mBuffered ? len : 32 - mBuffered;
+            std::memcpy(mBuffer + mBuffered, p, n);
+            mBuffered += n; p += n; len -= n;
+            if (mBuffered < 32)
+                return;
+            stripe(mBuffer);
+            mBuffered = 0;
+        }
+
+        for (; len >= 32; len -= 32, p += 32)
+            stripe(p);
+
+        std::memcpy(mBuffer, p, len);
+        mBuffered = len;
+    }
+
+    uint64_t value() const
+    {
+        uint64_t h;
+        if (mLength >= 32)
+        {
+            h = rotl(mV[0], 1) + rotl(mV[1], 7) + rotl(mV[2], 12) + rotl(mV[3], 18);
+            for (const uint64_t v : mV)
+                h = (h ^ round(0, v)) * P1 + P4;
+        }
+        else
+            h = P5;
+        h += mLength;
+
+        const unsigned char* p = mBuffer;
+        size_t len = mBuffered;
+        for (; len >= 8; len -= 8, p += 8)
+            h = rotl(h ^ round(0, read64(p)), 27) * P1 + P4;
+        if (len >= 4)
+        {
+            h = rotl(h ^ (read32(p) * P1), 23) * P2 + P3;
+            len -= 4; p += 4;
+        }
+        for (; len > 0; len--)
+            h = rotl(h ^ (*p++ * P5), 11) * P1;
+
+        h ^= h >> 33; h *= P2;
+        h ^= h >> 29; h *= P3;
+        h ^= h >> 32;
+        return h;
+    }
+
+private:
+    static constexpr uint64_t P1 = 0x9e3779b185ebca87, P2 = 0xc2b2ae3d27d4eb4f,
+                              P3 = 0x165667b19e3779f9, P4 = 0x85ebca77c2b2ae63,
+                              P5 = 0x27d4eb2f165667c5;
+
+    static uint64_t rotl(uint64_t x, int n) { return (x << n) | (x >> (64 - n)); }
+    static uint64_t round(uint64_t acc, uint64_t input) { return rotl(acc + input * P2, 31) * P1; }
+
+    // xxHash reads its input little endian.
+    static uint64_t read64(const unsigned char* p)
+    {
+        uint64_t v = 0;
+        for (int i = 7; i >= 0; i--) v = (v << 8) | p[i];
+        return v;
+    }
+    static uint64_t read32(const unsigned char* p)
+    {
+        return uint64_t(p[0]) | (uint64_t(p[1]) << 8) | (uint64_t(p[2]) << 16) | (uint64_t(p[3]) << 24);
+    }
+
+    void stripe(const unsigned char* p)
+    {
+        for (int i = 0; i < 4; i++)
+            mV[i] = round(mV[i], read64(p + 8 * i));
+    }
+
+    uint64_t mV[4] = { P1 + P2, P2, 0, 0 - P1 };
+    unsigned char mBuffer[32] = {};
+    size_t mBuffered = 0;
+    uint64_t mLength = 0;
+};
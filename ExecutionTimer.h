@@ -37,3 +37,16 @@ public:
 private:
     Clock::time_point mStart = Clock::now();
 };
+
+// The same clock as ExecutionTimer, but the caller reads the elapsed time
+// instead of having it printed. Used for benchmarking.
+class Stopwatch
+{
+public:
+    using Clock = ExecutionTimer::Clock;
+
+    void restart() { mStart = Clock::now(); }
+    double seconds() const { return duration<double>(Clock::now() - mStart).count(); }
+private:
+    Clock::time_point mStart = Clock::now();
+};
@@ -23,26 +23,91 @@
 
 #include <vector>
 #include <array>
+#include <span>
+#include <algorithm>
+#include <cstdint>
 #include <string>
+#include <string_view>
+#include <bit>
 #include <iostream>
 #include <iomanip>
 #include <fstream>
+#include <sstream>
+#include <cstdlib>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <coroutine>
+#include <exception>
+#include <utility>
+#include <tuple>
+#include <stdexcept>
+#include <cstring>
+#include <cerrno>
+#include <cctype>
+#include <optional>
+#include <unordered_map>
+#include <map>
+#include <set>
+#include <csignal>
+#include <filesystem>
+#include <random>
+#include <chrono>
 #include "ExecutionTimer.h"
+#include "Checksums.h"
+#ifdef SHA256_WITH_ZLIB
+#include <zlib.h>
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <climits>
+#endif
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define SHA256_X86 1
+#include <immintrin.h>
+#include <cpuid.h>
+#else
+#define SHA256_X86 0
+#endif
+
+#if defined(__linux__)
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <linux/fiemap.h>
+#include <linux/fs.h>
+#include <linux/if_alg.h>
+#include <sys/inotify.h>
+#endif
 
-#if defined(__GNUC__) || defined(__clang__)
-// GCC or Clang
+#if defined(__clang__)
+// Clang
 #define ROTL(x, shift) __builtin_rotateleft32(x, shift)
 #define ROTR(x, shift) __builtin_rotateright32(x, shift)
+#define ROTR64(x, shift) __builtin_rotateright64(x, shift)
 #elif defined(_MSC_VER)
 // Microsoft Visual Studio
 #include <stdlib.h> // Required for _rotl and _rotr
 #define ROTL(x, shift) _rotl(x, shift)
-#define ROTR(x, shift) _rotr(x, shift)
+#define ROTR(x, shift) std::rotr(x, shift)   // _rotr is not constexpr
+#define ROTR64(x, shift) _rotr64(x, shift)
 #else
-// Other compilers, fallback to standard C++
+// GCC and other compilers, fallback to standard C++
 #include <bit> // Required for std::rotl and std::rotr in C++20
 #define ROTL(x, shift) std::rotl(x, shift)
 #define ROTR(x, shift) std::rotr(x, shift)
+#define ROTR64(x, shift) std::rotr(x, shift)
 #endif
 
 // Type aliases to match the wording in the NIST.FIPS.180-4 SHA-256 specification.
@@ -58,7 +123,7 @@ using Schedule = std::array<uint32_t, 64>;
 // the cube roots of the first sixty-four prime numbers. In hex, these constant
 // words are (from left to right)
 
-static const SHA256_Constants K = {
+static constexpr SHA256_Constants K = {
     0x428a2f98,0x71374491,0xb5c0fbcf,0xe9b5dba5,
     0x3956c25b,0x59f111f1,0x923f82a4,0xab1c5ed5,
     0xd807aa98,0x12835b01,0x243185be,0x550c7dc3,
@@ -83,10 +148,42 @@ static const SHA256_Constants K = {
 // thirty-two bits of the fractional parts of the square roots of the first
 // eight prime numbers.
 
-static const Digest H0 = {
+static constexpr Digest H0 = {
     0x6a09e667,0xbb67ae85,0x3c6ef372,0xa54ff53a,
     0x510e527f,0x9b05688c,0x1f83d9ab,0x5be0cd19 };
 
+// Section 5.3.2 SHA-224
+//
+// SHA-224 is computed exactly like SHA-256 (section 6.3) but starts from
+// these words, the second thirty-two bits of the fractional parts of the
+// square roots of the ninth through sixteenth prime numbers, and the result
+// is truncated to the left-most 224 bits.
+
+static const Digest H0_224 = {
+    0xc1059ed8,0x367cd507,0x3070dd17,0xf70e5939,
+    0xffc00b31,0x68581511,0x64f98fa7,0xbefa4fa4 };
+
+// The variants of SHA-256 differ only in H(0) and in how many words of the
+// final hash value are output, so every kernel serves all of them: a Digest
+// always carries the full eight word state and is truncated when printed.
+struct Variant
+{
+    const char* name;       // As given to -a, and the kernel crypto API name
+    const char* label;      // As printed
+    const Digest& H0;
+    size_t words;           // Words of the digest that are output
+};
+
+static const std::array<Variant, 2> variants = { {
+    { "sha256", "SHA-256", H0, 8 },
+    { "sha224", "SHA-224", H0_224, 7 },
+} };
+
+static const Variant* gVariant = &variants[0];
+
+const Variant& activeVariant() { return *gVariant; }
+
+
 // Section 4.1.2 SHA-256 Functions
 //
 // SHA-256 uses six logical functions, where each function operates on 32-bit
@@ -96,12 +193,12 @@ static const Digest H0 = {
 // The 'Ch' function: This is short for "choose" and given three inputs x, y, z
 // returns bits from y where the corresponding bit in x is 1 and bits from z
 // where the corresponding bit in x is 0.
-inline uint32_t Ch(const uint32_t& x, const uint32_t& y, const uint32_t& z) { return (x & y) ^ ((~x) & z); }            // 4.2
+constexpr uint32_t Ch(const uint32_t& x, const uint32_t& y, const uint32_t& z) { return (x & y) ^ ((~x) & z); }            // 4.2
 
 // The 'Maj' function: Short for "majority", this function takes three inputs
 // x, y, z and for each bit index i if at least two of the bits xi, yi or zi
 // are set to 1 then so is the result mi.
-inline uint32_t Maj(const uint32_t& x, const uint32_t& y, const uint32_t& z) { return (x & y) ^ (x & z) ^ (y & z); }    // 4.3
+constexpr uint32_t Maj(const uint32_t& x, const uint32_t& y, const uint32_t& z) { return (x & y) ^ (x & z) ^ (y & z); }    // 4.3
 
 // The sigma functions: These are defined as bitwise operations on their input
 // word according to specific rules outlined in section 4 of NIST.FIPS.180-4.
@@ -109,10 +206,10 @@ inline uint32_t Maj(const uint32_t& x, const uint32_t& y, const uint32_t& z) { r
 // data when calculating a SHA-256 hash. The suffixes are the part of the
 // specification that defines each sigma function.
 // std::rotl(w, n);
-static auto sigma_4_4(const uint32_t& x) { return ROTR(x, 2)  ^ ROTR(x, 13) ^ ROTR(x, 22); } // 4.4
-static auto sigma_4_5(const uint32_t& x) { return ROTR(x, 6)  ^ ROTR(x, 11) ^ ROTR(x, 25); } // 4.5
-static auto sigma_4_6(const uint32_t& x) { return ROTR(x, 7)  ^ ROTR(x, 18) ^ (x >> 3); }   // 4.6
-static auto sigma_4_7(const uint32_t& x) { return ROTR(x, 17) ^ ROTR(x, 19) ^ (x >> 10); } // 4.7
+static constexpr auto sigma_4_4(const uint32_t& x) { return ROTR(x, 2)  ^ ROTR(x, 13) ^ ROTR(x, 22); } // 4.4
+static constexpr auto sigma_4_5(const uint32_t& x) { return ROTR(x, 6)  ^ ROTR(x, 11) ^ ROTR(x, 25); } // 4.5
+static constexpr auto sigma_4_6(const uint32_t& x) { return ROTR(x, 7)  ^ ROTR(x, 18) ^ (x >> 3); }   // 4.6
+static constexpr auto sigma_4_7(const uint32_t& x) { return ROTR(x, 17) ^ ROTR(x, 19) ^ (x >> 10); } // 4.7
 
 
 // 5.1 Padding The Message: The purpose of this padding is to ensure that the
@@ -123,31 +220,14 @@ Message pad(uint64_t l)
 {
     Message padding = { 0x80 };
 
-    if (l == 0)
-    {
-        // A zero length message is an edge case, but it has to be dealt with.
-        padding.resize(56, 0);
-    }
-    else if (l % 512 == 0)
-    {
-        // This is our favorite case. The message is already a multiple of 512
-        // bits in length.
-        return padding = {};
-    }
-    else if (l % 512 > 440)
-    {
-        // This is an annoying case. The message requires padding and adding an
-        // extra 512 bit block to the end. Pad remainder of block and add new block
-        const size_t k = 960 - (l % 1024 + 1);
-        padding.resize(k / 8 + 1, 0);
-    }
-    else
-    {
-        // This is a typical case. We add a 1 bit and zeros plus the length
-        // of the message in bits.
-        const size_t k = 448 - (l % 512 + 1);
-        padding.resize(k / 8 + 1, 0);
-    }
+    // A 1 bit is appended, followed by k zero bits, where k is the smallest
+    // non-negative solution to l + 1 + k = 448 mod 512. When the message
+    // already ends within 64 bits of a block boundary (or exactly on one),
+    // this spills the length into an extra 512 bit block. An empty message
+    // and a message that is a multiple of 512 bits both need a full block
+    // of padding.
+    const uint64_t k = (448 + 512 - (l % 512 + 1)) % 512;
+    padding.resize((k + 1) / 8, 0);
 
     // reinterpret_cast to treat the integer as an array of bytes
     const auto bytes = reinterpret_cast<unsigned char*>(&l);
@@ -168,7 +248,7 @@ Message pad(uint64_t l)
 // the algorithm as it is used to modify the initial hash value (H0) and
 // then each of the intermediate digests produced when processing each
 // block.
-Schedule schedule(const Block& M) {
+constexpr Schedule schedule(const Block& M) {
     Schedule W = {};
 
     // Copy the first 16 elements from M to W
@@ -183,7 +263,7 @@ Schedule schedule(const Block& M) {
 // 6.2.2 SHA-256 Hash Computation:
 // Run the message schedule. This does the work of producing the next
 // digest value from the current digest.
-Digest runschedule(const Schedule& W, Digest& H) {
+constexpr Digest runschedule(const Schedule& W, Digest& H) {
 
     uint32_t a(H[0]), b(H[1]), c(H[2]), d(H[3]),
         e(H[4]), f(H[5]), g(H[6]), h(H[7]);
@@ -260,7 +340,7 @@ Digest hashDigest(const Digest& d)
 {
     Digest digest = H0;
     const Digest startPad = { 0x80000000,0x00000000,0x00000000,0x00000000,
-                        0x00000000,0x00000000,0x00000000,0x00000200 };
+                        0x00000000,0x00000000,0x00000000,0x00000100 };
     Block B;
 
     int i = 0;
@@ -271,93 +351,5276 @@ Digest hashDigest(const Digest& d)
     return runschedule(s, digest);
 }
 
-// This is just a simple utility function to parse the command line
-// arguments into a vector<string> type.
-std::vector<std::string> arguments(const int argc, char* argv[]) {
-    std::vector<std::string> res;
+// Zeros for hashing holes without reading them.
+static const std::array<unsigned char, 4096> gZeros = {};
 
-    for (int i = 1; i < argc; i++)
-        res.emplace_back(argv[i]);
+// Blocks of zeros, as found in the holes of sparse files. With M = 0 every
+// schedule word is zero too (sigma_4_6(0) = sigma_4_7(0) = 0), so there is no
+// schedule to compute and each round only adds K[t].
+void compressZero(Digest& H, uint64_t blocks)
+{
+    for (; blocks > 0; blocks--)
+    {
+        uint32_t a(H[0]), b(H[1]), c(H[2]), d(H[3]),
+            e(H[4]), f(H[5]), g(H[6]), h(H[7]);
 
-    return res;
+        for (int t = 0; t < 64; t++)
+        {
+            const uint32_t T1(h + sigma_4_5(e) + Ch(e, f, g) + K[t]);
+            const uint32_t T2(sigma_4_4(a) + Maj(a, b, c));
+            h = g; g = f; f = e; e = d + T1; d = c; c = b;
+            b = a; a = T1 + T2;
+        }
+
+        H[0] += a; H[1] += b; H[2] += c; H[3] += d;
+        H[4] += e; H[5] += f; H[6] += g; H[7] += h;
+    }
 }
 
-// This implementation reads each file to be hashed into memory. This
-// works just fine for small files. Large files should be processed
-// by streaming the data which would change all the code above. In
-// practice, one would use a library function or utility like sha2
-// to calculate the hash/digest of a file. This is just an educational
-// example for acedemic purposes only.
-int main(const int argc, char* argv[])
+// 6.2.2 SHA-256 Hash Computation, one block at a time:
+// Each 64 byte chunk of the message is parsed into sixteen big endian 32 bit
+// words (5.2.1) and folded into the running digest. This is the same work the
+// loop in message() does, but it does not need the whole message in memory.
+void compressScalar(Digest& H, const unsigned char* p, size_t blocks)
 {
-    try {
-        const std::vector<std::string> args = arguments(argc, argv);
+    for (; blocks > 0; blocks--)
+    {
+        Block B;
+        for (auto& w : B)
+        {
+            w = (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) |
+                (uint32_t(p[2]) << 8) | uint32_t(p[3]);
+            p += 4;
+        }
+        runschedule(schedule(B), H);
+    }
+}
 
-        if (argc == 1) {
-            std::cout << "SHA-256 algorithm for educational purposes only!\n"
-                      << "$ sha256 [-] file1 [file2 ...]\n\n"
-                      << "Reads each file and provides a SHA-256 digest.\n"
-                      << "The - argument can appear anywhere in the argument\n"
-                      << "list. Files appearing after the - will be double hashed.\n"
-                      << "Bitcoin does this sha256(sha256(data)).\n"
-                      << "The output is a text hex representation of the "
-                      << "SHA-256 message digest.\n";
-            return 0;
+// Kernels:
+// A kernel is one implementation of the hash computation. In-process kernels
+// provide compress(), which folds whole blocks into the running digest, and
+// everything else (padding, streaming, double hashing) is shared. Multi-buffer
+// kernels provide compressLanes() instead, which hashes several independent
+// messages at once and is only used by hashBatch(). Offload kernels hand the
+// whole message to something outside this process and leave both null. The
+// dispatcher picks the first supported in-process kernel unless one is
+// selected by name with --kernel.
+struct Kernel
+{
+    const char* name;
+    const char* description;
+    bool (*supported)();
+    void (*compress)(Digest& H, const unsigned char* p, size_t blocks);
+    bool (*hashBuffer)(const unsigned char* p, size_t len, Digest& out);
+    bool (*hashFd)(int fd, Digest& out);
+    unsigned lanes = 1;
+    // state is transposed, state[word * lanes + lane], and every lane's
+    // pointer is advanced by 64 bytes per block.
+    void (*compressLanes)(uint32_t* state, const unsigned char* const* p, size_t blocks) = nullptr;
+};
+
+static bool always() { return true; }
+
+#if SHA256_X86
+// Intel SHA extensions. SHA256RNDS2 does two rounds at a time on the state
+// held as ABEF and CDGH, and SHA256MSG1/MSG2 compute the message schedule
+// four words at a time. The words of K are loaded four at a time straight
+// from the table above.
+static bool shaniSupported()
+{
+    unsigned eax, ebx, ecx, edx;
+    return __builtin_cpu_supports("sse4.1") &&
+           __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ebx & (1u << 29));
+}
+
+// The digest is rearranged from ABCD EFGH into ABEF CDGH on the way in, and
+// back on the way out.
+__attribute__((target("sha,sse4.1")))
+static inline void shaniLoad(const Digest& H, __m128i& state0, __m128i& state1)
+{
+    const __m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(&H[0])), 0xB1);
+    state1 = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(&H[4])), 0x1B);
+    state0 = _mm_alignr_epi8(tmp, state1, 8);
+    state1 = _mm_blend_epi16(state1, tmp, 0xF0);
+}
+
+__attribute__((target("sha,sse4.1")))
+static inline void shaniStore(Digest& H, __m128i state0, __m128i state1)
+{
+    const __m128i tmp = _mm_shuffle_epi32(state0, 0x1B);
+    state1 = _mm_shuffle_epi32(state1, 0xB1);
+    state0 = _mm_blend_epi16(tmp, state1, 0xF0);
+    state1 = _mm_alignr_epi8(state1, tmp, 8);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(&H[0]), state0);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(&H[4]), state1);
+}
+
+// Four rounds: schedule words 4i to 4i+3 into W[i & 3] (loaded from the block
+// for i < 4) and run them.
+__attribute__((target("sha,sse4.1")))
+static inline void shaniRounds(int i, __m128i* W, const unsigned char* p, __m128i& state0, __m128i& state1)
+{
+    const __m128i bswap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+
+    __m128i& w = W[i & 3];
+    if (i < 4)
+        w = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 16 * i)), bswap);
+    else
+    {
+        w = _mm_sha256msg1_epu32(w, W[(i - 3) & 3]);
+        w = _mm_add_epi32(w, _mm_alignr_epi8(W[(i - 1) & 3], W[(i - 2) & 3], 4));
+        w = _mm_sha256msg2_epu32(w, W[(i - 1) & 3]);
+    }
+
+    __m128i msg = _mm_add_epi32(w, _mm_loadu_si128(reinterpret_cast<const __m128i*>(&K[4 * i])));
+    state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+    msg = _mm_shuffle_epi32(msg, 0x0E);
+    state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+}
+
+__attribute__((target("sha,sse4.1")))
+static void compressShaNi(Digest& H, const unsigned char* p, size_t blocks)
+{
+    __m128i state0, state1;
+    shaniLoad(H, state0, state1);
+
+    for (; blocks > 0; blocks--, p += 64)
+    {
+        const __m128i abef = state0;
+        const __m128i cdgh = state1;
+
+        // W holds the last sixteen schedule words as four groups of four.
+        __m128i W[4];
+#pragma GCC unroll 16
+        for (int i = 0; i < 16; i++)
+            shaniRounds(i, W, p, state0, state1);
+
+        state0 = _mm_add_epi32(state0, abef);
+        state1 = _mm_add_epi32(state1, cdgh);
+    }
+
+    shaniStore(H, state0, state1);
+}
+
+// Two messages at once on the SHA extensions. SHA256RNDS2 has a latency of
+// several cycles but can start every cycle or two, so a single message, whose
+// every pair of rounds waits for the one before, leaves the unit idle most of
+// the time. Issuing the rounds of two independent messages alternately fills
+// those gaps. This is a multi-buffer kernel with two lanes.
+__attribute__((target("sha,sse4.1")))
+static void compressShaNix2(uint32_t* state, const unsigned char* const* lanes, size_t blocks)
+{
+    Digest H[2];
+    __m128i state0[2], state1[2];
+    for (int l = 0; l < 2; l++)
+    {
+        for (int w = 0; w < 8; w++)
+            H[l][w] = state[2 * w + l];
+        shaniLoad(H[l], state0[l], state1[l]);
+    }
+
+    for (size_t n = 0; n < blocks; n++)
+    {
+        const __m128i abef0 = state0[0], cdgh0 = state1[0];
+        const __m128i abef1 = state0[1], cdgh1 = state1[1];
+        const unsigned char* p0 = lanes[0] + 64 * n;
+        const unsigned char* p1 = lanes[1] + 64 * n;
+
+        __m128i W0[4], W1[4];
+#pragma GCC unroll 16
+        for (int i = 0; i < 16; i++)
+        {
+            shaniRounds(i, W0, p0, state0[0], state1[0]);
+            shaniRounds(i, W1, p1, state0[1], state1[1]);
         }
 
-        Message msg = {};
-        msg.reserve(1024);
+        state0[0] = _mm_add_epi32(state0[0], abef0);
+        state1[0] = _mm_add_epi32(state1[0], cdgh0);
+        state0[1] = _mm_add_epi32(state0[1], abef1);
+        state1[1] = _mm_add_epi32(state1[1], cdgh1);
+    }
 
-        bool doublehash = false;
-        for (const auto& file : args)
+    for (int l = 0; l < 2; l++)
+    {
+        shaniStore(H[l], state0[l], state1[l]);
+        for (int w = 0; w < 8; w++)
+            state[2 * w + l] = H[l][w];
+    }
+}
+
+// Scalar code for x86-64 with BMI1/BMI2. The rounds are unrolled eight at a
+// time with the variables renamed instead of shifted, the schedule is kept
+// as a ring of sixteen words computed just before it is used, the rotations
+// compile to RORX (three operands, no flags, so they do not serialise with
+// the adds), Ch to ANDN, and Maj(a, b, c) is computed as ((a ^ b) & (b ^ c)) ^ b
+// where b ^ c is the previous round's a ^ b. The two halves of Ch have no bits
+// in common, so they are added rather than xored, which gives the compiler
+// more freedom to reorder.
+static bool bmi2Supported() { return __builtin_cpu_supports("bmi") && __builtin_cpu_supports("bmi2"); }
+
+__attribute__((target("bmi,bmi2")))
+static inline void roundBmi2(uint32_t a, uint32_t b, uint32_t& d, uint32_t e, uint32_t f, uint32_t g,
+                             uint32_t& h, uint32_t kw, uint32_t& bc)
+{
+    h += kw + (ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25)) + (e & f) + (~e & g);
+    d += h;
+    const uint32_t ab = a ^ b;
+    h += (ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22)) + ((ab & bc) ^ b);
+    bc = ab;
+}
+
+__attribute__((target("bmi,bmi2")))
+static void compressBmi2(Digest& H, const unsigned char* p, size_t blocks)
+{
+    for (; blocks > 0; blocks--, p += 64)
+    {
+        uint32_t W[16];
+        for (int t = 0; t < 16; t++)
+            W[t] = (uint32_t(p[4 * t]) << 24) | (uint32_t(p[4 * t + 1]) << 16) |
+                   (uint32_t(p[4 * t + 2]) << 8) | uint32_t(p[4 * t + 3]);
+
+        // Schedule word t plus its constant, updating the ring in place.
+        auto kw = [&](int t) {
+            if (t >= 16)
+                W[t & 15] += sigma_4_7(W[(t - 2) & 15]) + W[(t - 7) & 15] + sigma_4_6(W[(t - 15) & 15]);
+            return K[t] + W[t & 15];
+        };
+
+        uint32_t a = H[0], b = H[1], c = H[2], d = H[3], e = H[4], f = H[5], g = H[6], h = H[7];
+        uint32_t bc = b ^ c;
+#pragma GCC unroll 8
+        for (int t = 0; t < 64; t += 8)
+        {
+            roundBmi2(a, b, d, e, f, g, h, kw(t), bc);
+            roundBmi2(h, a, c, d, e, f, g, kw(t + 1), bc);
+            roundBmi2(g, h, b, c, d, e, f, kw(t + 2), bc);
+            roundBmi2(f, g, a, b, c, d, e, kw(t + 3), bc);
+            roundBmi2(e, f, h, a, b, c, d, kw(t + 4), bc);
+            roundBmi2(d, e, g, h, a, b, c, kw(t + 5), bc);
+            roundBmi2(c, d, f, g, h, a, b, kw(t + 6), bc);
+            roundBmi2(b, c, e, f, g, h, a, kw(t + 7), bc);
+        }
+
+        H[0] += a; H[1] += b; H[2] += c; H[3] += d;
+        H[4] += e; H[5] += f; H[6] += g; H[7] += h;
+    }
+}
+
+// AVX2 multi-buffer: eight independent messages are hashed at once, one per
+// 32 bit lane, by running the same schedule()/runschedule() steps on vectors.
+// The state is kept transposed, state[word * 8 + lane].
+static bool avx2Supported() { return __builtin_cpu_supports("avx2"); }
+
+__attribute__((target("avx2")))
+static inline __m256i rotr8(__m256i x, int n)
+{
+    return _mm256_or_si256(_mm256_srli_epi32(x, n), _mm256_slli_epi32(x, 32 - n));
+}
+
+__attribute__((target("avx2")))
+static void compressAvx2x8(uint32_t* state, const unsigned char* const* lanes, size_t blocks)
+{
+    __m256i s[8];
+    for (int i = 0; i < 8; i++)
+        s[i] = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(state + 8 * i));
+
+    for (size_t n = 0; n < blocks; n++)
+    {
+        // Gather word t of every lane's block into one vector.
+        alignas(32) uint32_t M[16][8];
+        for (int l = 0; l < 8; l++)
+        {
+            const unsigned char* p = lanes[l] + 64 * n;
+            for (int t = 0; t < 16; t++, p += 4)
+                M[t][l] = (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) |
+                          (uint32_t(p[2]) << 8) | uint32_t(p[3]);
+        }
+
+        __m256i a = s[0], b = s[1], c = s[2], d = s[3],
+                e = s[4], f = s[5], g = s[6], h = s[7];
+        __m256i W[16];
+        for (int t = 0; t < 64; t++)
         {
-            if (file == std::string("-"))
+            __m256i& w = W[t & 15];
+            if (t < 16)
+                w = _mm256_load_si256(reinterpret_cast<const __m256i*>(M[t]));
+            else
             {
-                doublehash = true;
-                continue;
+                const __m256i w2 = W[(t - 2) & 15], w15 = W[(t - 15) & 15];
+                const __m256i s1 = _mm256_xor_si256(_mm256_xor_si256(rotr8(w2, 17), rotr8(w2, 19)), _mm256_srli_epi32(w2, 10));
+                const __m256i s0 = _mm256_xor_si256(_mm256_xor_si256(rotr8(w15, 7), rotr8(w15, 18)), _mm256_srli_epi32(w15, 3));
+                w = _mm256_add_epi32(_mm256_add_epi32(s1, W[(t - 7) & 15]), _mm256_add_epi32(s0, w));
             }
 
-            std::ifstream infile(file, std::ios::binary);
-            infile.seekg(0, std::ios::end);
-            size_t fileSize = infile.tellg();
+            const __m256i S1 = _mm256_xor_si256(_mm256_xor_si256(rotr8(e, 6), rotr8(e, 11)), rotr8(e, 25));
+            const __m256i ch = _mm256_xor_si256(_mm256_and_si256(e, f), _mm256_andnot_si256(e, g));
+            const __m256i T1 = _mm256_add_epi32(_mm256_add_epi32(_mm256_add_epi32(h, S1), _mm256_add_epi32(ch, w)),
+                                                _mm256_set1_epi32(static_cast<int>(K[t])));
+            const __m256i S0 = _mm256_xor_si256(_mm256_xor_si256(rotr8(a, 2), rotr8(a, 13)), rotr8(a, 22));
+            const __m256i maj = _mm256_xor_si256(_mm256_and_si256(a, b),
+                                                 _mm256_and_si256(c, _mm256_xor_si256(a, b)));
+            const __m256i T2 = _mm256_add_epi32(S0, maj);
+            h = g; g = f; f = e; e = _mm256_add_epi32(d, T1); d = c; c = b;
+            b = a; a = _mm256_add_epi32(T1, T2);
+        }
 
-            msg.resize(fileSize);
+        s[0] = _mm256_add_epi32(s[0], a); s[1] = _mm256_add_epi32(s[1], b);
+        s[2] = _mm256_add_epi32(s[2], c); s[3] = _mm256_add_epi32(s[3], d);
+        s[4] = _mm256_add_epi32(s[4], e); s[5] = _mm256_add_epi32(s[5], f);
+        s[6] = _mm256_add_epi32(s[6], g); s[7] = _mm256_add_epi32(s[7], h);
+    }
 
-            // Seek back to the beginning of the file
-            infile.seekg(0, std::ios::beg);
+    for (int i = 0; i < 8; i++)
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(state + 8 * i), s[i]);
+}
+#endif
 
-            // Read the entire file into the vector
-            infile.read(reinterpret_cast<char*>(msg.data()), fileSize);
 
-            infile.close();
-            {
-                ExecutionTimer tm;
-                Digest digest = message(msg);
+#if defined(__linux__)
+// The Linux kernel crypto API through an AF_ALG socket. The data is hashed by
+// whatever sha256 driver the kernel has, which may be a hardware accelerator.
+// Files are spliced into the socket through a pipe, so their contents never
+// get copied into user space.
+static int afalgOpen()
+{
+    const int tfm = ::socket(AF_ALG, SOCK_SEQPACKET, 0);
+    if (tfm < 0)
+        return -1;
 
-	            if (doublehash)
-	            {
-	                digest = hashDigest(digest);
-	                std::cout << " double hashed";
-	            }
+    sockaddr_alg sa = {};
+    sa.salg_family = AF_ALG;
+    std::strcpy(reinterpret_cast<char*>(sa.salg_type), "hash");
+    std::strcpy(reinterpret_cast<char*>(sa.salg_name), activeVariant().name);
 
-	            std::cout << "SHA-256 (" << file << ") = ";
-	            for (const auto& w : digest)
-	                std::cout << std::setw(8) << std::setfill('0') << std::hex << w;
-	            std::cout << std::endl;
-            }
+    int op = -1;
+    if (::bind(tfm, reinterpret_cast<sockaddr*>(&sa), sizeof(sa)) == 0)
+        op = ::accept(tfm, nullptr, nullptr);
+    ::close(tfm);
+    return op;
+}
+
+// Everything was sent with MSG_MORE, so an empty send finishes the hash.
+static bool afalgFinish(int op, Digest& out)
+{
+    unsigned char bytes[32];
+    const size_t words = activeVariant().words;
+    const bool ok = ::send(op, nullptr, 0, 0) == 0 &&
+                    ::read(op, bytes, 4 * words) == ssize_t(4 * words);
+    ::close(op);
+    if (ok)
+        for (size_t i = 0; i < words; i++)
+            out[i] = (uint32_t(bytes[4 * i]) << 24) | (uint32_t(bytes[4 * i + 1]) << 16) |
+                     (uint32_t(bytes[4 * i + 2]) << 8) | uint32_t(bytes[4 * i + 3]);
+    return ok;
+}
+
+static bool afalgSupported()
+{
+    static const bool supported = [] {
+        const int op = afalgOpen();
+        if (op >= 0) ::close(op);
+        return op >= 0;
+    }();
+    return supported;
+}
+
+static bool afalgHashBuffer(const unsigned char* p, size_t len, Digest& out)
+{
+    const int op = afalgOpen();
+    if (op < 0)
+        return false;
+
+    while (len > 0)
+    {
+        const ssize_t n = ::send(op, p, len, MSG_MORE);
+        if (n <= 0) { ::close(op); return false; }
+        p += n; len -= n;
+    }
+    return afalgFinish(op, out);
+}
+
+static bool afalgHashFd(int fd, Digest& out)
+{
+    const int op = afalgOpen();
+    if (op < 0)
+        return false;
+
+    int pipefd[2];
+    if (::pipe(pipefd) != 0) { ::close(op); return false; }
 
-            msg = {};
+    // The kernel accepts at most 16 pages per splice into the socket.
+    const size_t chunk = 16 * 4096;
+    bool ok = true;
+    for (;;)
+    {
+        ssize_t n = ::splice(fd, nullptr, pipefd[1], nullptr, chunk, SPLICE_F_MOVE);
+        if (n <= 0) { ok = n == 0; break; }
+        while (n > 0)
+        {
+            const ssize_t m = ::splice(pipefd[0], nullptr, op, nullptr, n, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (m <= 0) { ok = false; break; }
+            n -= m;
         }
+        if (!ok) break;
     }
-    // Honestly if we catch an error, there is a bug somewhere in the
-    // code that I have not caught. Pun intended.
-    catch (std::out_of_range) {
-        std::cerr << "range error" << std::endl;
+
+    ::close(pipefd[0]);
+    ::close(pipefd[1]);
+    if (!ok) { ::close(op); return false; }
+    return afalgFinish(op, out);
+}
+#endif
+
+const std::vector<Kernel>& kernels()
+{
+    static const std::vector<Kernel> list = {
+#if SHA256_X86
+        { "shani", "Intel SHA extensions", shaniSupported, compressShaNi, nullptr, nullptr },
+        { "bmi2", "scalar with BMI2 rotates and ANDN", bmi2Supported, compressBmi2, nullptr, nullptr },
+#endif
+        { "scalar", "portable C++ (schedule/runschedule)", always, compressScalar, nullptr, nullptr },
+#if SHA256_X86
+        { "shanix2", "Intel SHA extensions, 2 messages interleaved", shaniSupported, nullptr, nullptr, nullptr, 2, compressShaNix2 },
+        { "avx2x8", "AVX2 multi-buffer, 8 messages at once", avx2Supported, nullptr, nullptr, nullptr, 8, compressAvx2x8 },
+#endif
+#if defined(__linux__)
+        { "afalg", "Linux kernel crypto API via AF_ALG and splice", afalgSupported, nullptr, afalgHashBuffer, afalgHashFd },
+#endif
+    };
+    return list;
+}
+
+static const Kernel* gKernel = nullptr;
+static bool gKernelSelected = false;    // Chosen with --kernel, overrides tuning
+
+const Kernel& activeKernel()
+{
+    if (gKernel == nullptr)
+        for (const auto& k : kernels())
+            if (k.compress && k.supported()) { gKernel = &k; break; }
+    return *gKernel;
+}
+
+// Selects a kernel by name. Returns false if there is no such kernel or it
+// cannot run on this machine.
+// Multi-buffer kernels only hash batches, so they cannot be selected.
+bool selectKernel(const std::string& name)
+{
+    for (const auto& k : kernels())
+        if (name == k.name && k.supported() && !(k.compressLanes && !k.compress))
+        {
+            gKernel = &k;
+            gKernelSelected = true;
+            return true;
+        }
+    return false;
+}
+
+// A streaming version of message(). Data is fed in with update() in pieces
+// of any size and final() pads what is left over and returns the digest.
+// Only a partial block is ever buffered, so the message length is limited
+// by the 64 bit length field and not by memory.
+class Hasher
+{
+public:
+    // Offload kernels cannot resume from a digest, so streaming falls back to
+    // the scalar code for them.
+    explicit Hasher(const Kernel& kernel = activeKernel(), const Variant& variant = activeVariant())
+        : mCompress(kernel.compress ? kernel.compress : compressScalar), mH(variant.H0) {}
+
+    // Resumes from the digest reached after length bytes, a multiple of 64.
+    Hasher(const Digest& midstate, uint64_t length, const Kernel& kernel = activeKernel())
+        : mCompress(kernel.compress ? kernel.compress : compressScalar), mH(midstate), mLength(length) {}
+
+    void update(const unsigned char* data, size_t len)
+    {
+        mLength += len;
+        absorb(data, len);
     }
-    catch (...) {
-        std::cerr << "unknown exception thrown" << std::endl;
+
+    // Hashes len zero bytes. The portable kernel has a cheaper compression for
+    // whole zero blocks; the others are as fast or faster on real zeros.
+    void updateZeros(uint64_t len)
+    {
+        mLength += len;
+        if (mBuffered > 0)
+        {
+            const size_t n = std::min<uint64_t>(len, mBuffer.size() - mBuffered);
+            absorb(gZeros.data(), n);
+            len -= n;
+        }
+
+        if (mCompress == compressScalar)
+        {
+            compressZero(mH, len / 64);
+            len %= 64;
+        }
+        for (; len > 0; len -= std::min<uint64_t>(len, gZeros.size()))
+            absorb(gZeros.data(), std::min<uint64_t>(len, gZeros.size()));
     }
 
-    return 0;
+    Digest final()
+    {
+        const Message padding = pad(mLength * 8);
+        absorb(padding.data(), padding.size());
+        return mH;
+    }
+
+private:
+    void absorb(const unsigned char* data, size_t len)
+    {
+        // Top up a partially filled block first.
+        if (mBuffered > 0)
+        {
+            const size_t n = std::min(len, mBuffer.size() - mBuffered);
+            std::copy_n(data, n, mBuffer.begin() + mBuffered);
+            mBuffered += n; data += n; len -= n;
+            if (mBuffered < mBuffer.size())
+                return;
+            mCompress(mH, mBuffer.data(), 1);
+            mBuffered = 0;
+        }
+
+        // Whole blocks are hashed straight out of the caller's buffer.
+        mCompress(mH, data, len / 64);
+        data += len - len % 64;
+        len %= 64;
+
+        std::copy_n(data, len, mBuffer.begin());
+        mBuffered = len;
+    }
+
+    void (*mCompress)(Digest&, const unsigned char*, size_t);
+    Digest mH;
+    std::array<unsigned char, 64> mBuffer = {};
+    size_t mBuffered = 0;
+    uint64_t mLength = 0;
+};
+
+// Tagged hashes:
+// BIP340 (Schnorr signatures and Taproot) hashes a message under a tag as
+// SHA-256(SHA-256(tag) || SHA-256(tag) || msg). The first 64 bytes are the
+// same for every message under a tag, so TaggedHasher keeps the digest after
+// that block, the midstate, and resumes from it: one compression fewer per
+// call. The midstate is computed with the constexpr schedule() and
+// runschedule(), so the tags BIP340 and BIP341 define are worked out by the
+// compiler, and others once when their TaggedHasher is made.
+
+// SHA-256 of a string, usable in constant expressions. It runs on the same
+// schedule() and runschedule() as message().
+constexpr Digest sha256Constexpr(std::string_view text)
+{
+    Digest H = H0;
+    Block B = {};
+    size_t filled = 0;
+    auto push = [&](unsigned char byte) {
+        B[filled / 4] |= uint32_t(byte) << (24 - 8 * (filled % 4));
+        if (++filled == 64)
+        {
+            runschedule(schedule(B), H);
+            B = {};
+            filled = 0;
+        }
+    };
+    for (const char c : text)
+        push(static_cast<unsigned char>(c));
+    push(0x80);
+    while (filled != 56)
+        push(0);
+    for (int shift = 56; shift >= 0; shift -= 8)
+        push(static_cast<unsigned char>(uint64_t(text.size()) * 8 >> shift));
+    return H;
+}
+
+static_assert(sha256Constexpr("abc")[0] == 0xba7816bf && sha256Constexpr("abc")[7] == 0xf20015ad,
+              "constexpr SHA-256 known answer");
+
+// The digest after the block SHA-256(tag) || SHA-256(tag), which is already
+// in words, like the block hashDigest() builds.
+constexpr Digest tagMidstate(std::string_view tag)
+{
+    const Digest t = sha256Constexpr(tag);
+    Block B = {};
+    for (size_t i = 0; i < 8; i++)
+        B[i] = B[8 + i] = t[i];
+    Digest H = H0;
+    return runschedule(schedule(B), H);
+}
+
+class TaggedHasher
+{
+public:
+    constexpr explicit TaggedHasher(std::string_view tag) : mMidstate(tagMidstate(tag)) {}
+
+    // A hasher past the tag prefix, for a message given in pieces.
+    Hasher start() const { return Hasher(mMidstate, 64); }
+
+    Digest operator()(const unsigned char* p, size_t len) const
+    {
+        Hasher hasher = start();
+        hasher.update(p, len);
+        return hasher.final();
+    }
+
+    constexpr const Digest& midstate() const { return mMidstate; }
+
+private:
+    Digest mMidstate;
+};
+
+// The tags of BIP340 and BIP341.
+inline constexpr TaggedHasher kBip340Aux("BIP0340/aux");
+inline constexpr TaggedHasher kBip340Nonce("BIP0340/nonce");
+inline constexpr TaggedHasher kBip340Challenge("BIP0340/challenge");
+inline constexpr TaggedHasher kTapLeaf("TapLeaf");
+inline constexpr TaggedHasher kTapBranch("TapBranch");
+inline constexpr TaggedHasher kTapTweak("TapTweak");
+inline constexpr TaggedHasher kTapSighash("TapSighash");
+
+// SHA-512, SHA-384 and SHA-512/256:
+// The SHA-512 family is the same construction as SHA-256 with 64 bit words,
+// 80 rounds, 1024 bit blocks and a 128 bit length field. On 64 bit machines
+// without SHA extensions it moves twice as many bits per round, which makes
+// it faster per byte than SHA-256. The code below mirrors the SHA-256 code
+// above, function for function.
+using Digest512 = std::array<uint64_t, 8>;
+using Block512 = std::array<uint64_t, 16>;
+using Schedule512 = std::array<uint64_t, 80>;
+
+// Section 4.2.3 SHA-384, SHA-512, SHA-512/224 and SHA-512/256 Constants
+//
+// The first sixty-four bits of the fractional parts of the cube roots of the
+// first eighty prime numbers.
+
+static const std::array<uint64_t, 80> K512 = {
+    0x428a2f98d728ae22,0x7137449123ef65cd,
+    0xb5c0fbcfec4d3b2f,0xe9b5dba58189dbbc,
+    0x3956c25bf348b538,0x59f111f1b605d019,
+    0x923f82a4af194f9b,0xab1c5ed5da6d8118,
+    0xd807aa98a3030242,0x12835b0145706fbe,
+    0x243185be4ee4b28c,0x550c7dc3d5ffb4e2,
+    0x72be5d74f27b896f,0x80deb1fe3b1696b1,
+    0x9bdc06a725c71235,0xc19bf174cf692694,
+    0xe49b69c19ef14ad2,0xefbe4786384f25e3,
+    0x0fc19dc68b8cd5b5,0x240ca1cc77ac9c65,
+    0x2de92c6f592b0275,0x4a7484aa6ea6e483,
+    0x5cb0a9dcbd41fbd4,0x76f988da831153b5,
+    0x983e5152ee66dfab,0xa831c66d2db43210,
+    0xb00327c898fb213f,0xbf597fc7beef0ee4,
+    0xc6e00bf33da88fc2,0xd5a79147930aa725,
+    0x06ca6351e003826f,0x142929670a0e6e70,
+    0x27b70a8546d22ffc,0x2e1b21385c26c926,
+    0x4d2c6dfc5ac42aed,0x53380d139d95b3df,
+    0x650a73548baf63de,0x766a0abb3c77b2a8,
+    0x81c2c92e47edaee6,0x92722c851482353b,
+    0xa2bfe8a14cf10364,0xa81a664bbc423001,
+    0xc24b8b70d0f89791,0xc76c51a30654be30,
+    0xd192e819d6ef5218,0xd69906245565a910,
+    0xf40e35855771202a,0x106aa07032bbd1b8,
+    0x19a4c116b8d2d0c8,0x1e376c085141ab53,
+    0x2748774cdf8eeb99,0x34b0bcb5e19b48a8,
+    0x391c0cb3c5c95a63,0x4ed8aa4ae3418acb,
+    0x5b9cca4f7763e373,0x682e6ff3d6b2b8a3,
+    0x748f82ee5defb2fc,0x78a5636f43172f60,
+    0x84c87814a1f0ab72,0x8cc702081a6439ec,
+    0x90befffa23631e28,0xa4506cebde82bde9,
+    0xbef9a3f7b2c67915,0xc67178f2e372532b,
+    0xca273eceea26619c,0xd186b8c721c0c207,
+    0xeada7dd6cde0eb1e,0xf57d4f7fee6ed178,
+    0x06f067aa72176fba,0x0a637dc5a2c898a6,
+    0x113f9804bef90dae,0x1b710b35131c471b,
+    0x28db77f523047d84,0x32caab7b40c72493,
+    0x3c9ebe0a15c9bebc,0x431d67c49c100d4c,
+    0x4cc5d4becb3e42b6,0x597f299cfc657e2a,
+    0x5fcb6fab3ad6faec,0x6c44198c4a475817 };
+
+// Section 5.3.5 SHA-512: the first sixty-four bits of the fractional parts of
+// the square roots of the first eight prime numbers.
+
+static const Digest512 H0_512 = {
+    0x6a09e667f3bcc908,0xbb67ae8584caa73b,
+    0x3c6ef372fe94f82b,0xa54ff53a5f1d36f1,
+    0x510e527fade682d1,0x9b05688c2b3e6c1f,
+    0x1f83d9abfb41bd6b,0x5be0cd19137e2179 };
+
+// Section 5.3.4 SHA-384: the same for the ninth through sixteenth primes.
+
+static const Digest512 H0_384 = {
+    0xcbbb9d5dc1059ed8,0x629a292a367cd507,
+    0x9159015a3070dd17,0x152fecd8f70e5939,
+    0x67332667ffc00b31,0x8eb44a8768581511,
+    0xdb0c2e0d64f98fa7,0x47b5481dbefa4fa4 };
+
+// Section 5.3.6.2 SHA-512/256: produced by the SHA-512/t IV generation
+// function of section 5.3.6 with t = 256.
+
+static const Digest512 H0_512_256 = {
+    0x22312194fc2bf72c,0x9f555fa3c84c64c2,
+    0x2393b86b6f53b151,0x963877195940eabd,
+    0x96283ee2a88effe3,0xbe5e1e2553863992,
+    0x2b0199fc2c85b8aa,0x0eb72ddc81c52ca2 };
+
+struct Variant512
+{
+    const char* name;
+    const char* label;
+    const Digest512& H0;
+    size_t words;           // 64 bit words of the digest that are output
+};
+
+static const std::array<Variant512, 3> variants512 = { {
+    { "sha512", "SHA-512", H0_512, 8 },
+    { "sha384", "SHA-384", H0_384, 6 },
+    { "sha512/256", "SHA-512/256", H0_512_256, 4 },
+} };
+
+// Null while a SHA-256 family variant is selected.
+static const Variant512* gVariant512 = nullptr;
+
+// Selects an algorithm from either family by name.
+bool selectVariant(const std::string& name)
+{
+    for (const auto& v : variants)
+        if (name == v.name) { gVariant = &v; gVariant512 = nullptr; return true; }
+    for (const auto& v : variants512)
+        if (name == v.name) { gVariant512 = &v; return true; }
+    return false;
+}
+
+// Section 4.1.3 SHA-384, SHA-512, SHA-512/224 and SHA-512/256 Functions
+//
+// Ch and Maj are the same as for SHA-256 on wider words.
+inline uint64_t Ch(const uint64_t& x, const uint64_t& y, const uint64_t& z) { return (x & y) ^ ((~x) & z); }            // 4.8
+inline uint64_t Maj(const uint64_t& x, const uint64_t& y, const uint64_t& z) { return (x & y) ^ (x & z) ^ (y & z); }    // 4.9
+static auto sigma_4_10(const uint64_t& x) { return ROTR64(x, 28) ^ ROTR64(x, 34) ^ ROTR64(x, 39); } // 4.10
+static auto sigma_4_11(const uint64_t& x) { return ROTR64(x, 14) ^ ROTR64(x, 18) ^ ROTR64(x, 41); } // 4.11
+static auto sigma_4_12(const uint64_t& x) { return ROTR64(x, 1)  ^ ROTR64(x, 8)  ^ (x >> 7); }     // 4.12
+static auto sigma_4_13(const uint64_t& x) { return ROTR64(x, 19) ^ ROTR64(x, 61) ^ (x >> 6); }     // 4.13
+
+// 5.1.2 Padding for SHA-512: a 1 bit, then zeros up to 896 mod 1024 bits,
+// then the message length in bits as a 128 bit big endian number. The length
+// is given here in bytes.
+Message pad512(uint64_t bytes)
+{
+    Message padding = { 0x80 };
+    padding.resize((128 + 112 - (bytes % 128 + 1)) % 128 + 1, 0);
+
+    const uint64_t high = bytes >> 61, low = bytes << 3;
+    for (int i = 56; i >= 0; i -= 8) padding.push_back(static_cast<unsigned char>(high >> i));
+    for (int i = 56; i >= 0; i -= 8) padding.push_back(static_cast<unsigned char>(low >> i));
+    return padding;
+}
+
+// 6.4.2 SHA-512 Hash Computation: the 80 word message schedule.
+Schedule512 schedule512(const Block512& M)
+{
+    Schedule512 W = {};
+
+    std::ranges::copy(M, W.begin());
+    for (int t = 16; t < 80; ++t) {
+        W[t] = sigma_4_13(W[t - 2]) + W[t - 7] + sigma_4_12(W[t - 15]) + W[t - 16];
+    }
+
+    return W;
 }
 
+// 6.4.2 SHA-512 Hash Computation: run the message schedule.
+Digest512 runschedule512(const Schedule512& W, Digest512& H)
+{
+    uint64_t a(H[0]), b(H[1]), c(H[2]), d(H[3]),
+        e(H[4]), f(H[5]), g(H[6]), h(H[7]);
+
+    for (int t = 0; t < 80; t++)
+    {
+        const uint64_t T1(h + sigma_4_11(e) + Ch(e, f, g) + K512[t] + W[t]);
+        const uint64_t T2(sigma_4_10(a) + Maj(a, b, c));
+        h = g; g = f; f = e; e = d + T1; d = c; c = b;
+        b = a; a = T1 + T2;
+    }
+
+    H[0] += a; H[1] += b; H[2] += c; H[3] += d;
+    H[4] += e; H[5] += f; H[6] += g; H[7] += h;
+
+    return H;
+}
+
+void compress512(Digest512& H, const unsigned char* p, size_t blocks)
+{
+    for (; blocks > 0; blocks--)
+    {
+        Block512 B;
+        for (auto& w : B)
+        {
+            w = 0;
+            for (int i = 0; i < 8; i++)
+                w = (w << 8) | *p++;
+        }
+        runschedule512(schedule512(B), H);
+    }
+}
+
+// The streaming hasher for the SHA-512 family, like Hasher.
+class Hasher512
+{
+public:
+    explicit Hasher512(const Variant512& variant = *gVariant512) : mH(variant.H0) {}
+
+    void update(const unsigned char* data, size_t len)
+    {
+        mLength += len;
+        absorb(data, len);
+    }
+
+    void updateZeros(uint64_t len)
+    {
+        for (; len > 0; len -= std::min<uint64_t>(len, gZeros.size()))
+            update(gZeros.data(), std::min<uint64_t>(len, gZeros.size()));
+    }
+
+    Digest512 final()
+    {
+        const Message padding = pad512(mLength);
+        absorb(padding.data(), padding.size());
+        return mH;
+    }
+
+private:
+    void absorb(const unsigned char* data, size_t len)
+    {
+        if (mBuffered > 0)
+        {
+            const size_t n = std::min(len, mBuffer.size() - mBuffered);
+            std::copy_n(data, n, mBuffer.begin() + mBuffered);
+            mBuffered += n; data += n; len -= n;
+            if (mBuffered < mBuffer.size())
+                return;
+            compress512(mH, mBuffer.data(), 1);
+            mBuffered = 0;
+        }
+
+        compress512(mH, data, len / 128);
+        data += len - len % 128;
+        len %= 128;
+
+        std::copy_n(data, len, mBuffer.begin());
+        mBuffered = len;
+    }
+
+    Digest512 mH;
+    std::array<unsigned char, 128> mBuffer = {};
+    size_t mBuffered = 0;
+    uint64_t mLength = 0;
+};
+
+#if SHA256_X86
+// AVX2 multi-buffer SHA-512: four messages at once, one per 64 bit lane.
+// The state is transposed, state[word * 4 + lane], as for compressAvx2x8().
+__attribute__((target("avx2")))
+static inline __m256i rotr4(__m256i x, int n)
+{
+    return _mm256_or_si256(_mm256_srli_epi64(x, n), _mm256_slli_epi64(x, 64 - n));
+}
+
+__attribute__((target("avx2")))
+static void compress512Avx2x4(uint64_t* state, const unsigned char* const* lanes, size_t blocks)
+{
+    __m256i s[8];
+    for (int i = 0; i < 8; i++)
+        s[i] = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(state + 4 * i));
+
+    for (size_t n = 0; n < blocks; n++)
+    {
+        alignas(32) uint64_t M[16][4];
+        for (int l = 0; l < 4; l++)
+        {
+            const unsigned char* p = lanes[l] + 128 * n;
+            for (int t = 0; t < 16; t++)
+            {
+                uint64_t w = 0;
+                for (int i = 0; i < 8; i++)
+                    w = (w << 8) | *p++;
+                M[t][l] = w;
+            }
+        }
+
+        __m256i a = s[0], b = s[1], c = s[2], d = s[3],
+                e = s[4], f = s[5], g = s[6], h = s[7];
+        __m256i W[16];
+        for (int t = 0; t < 80; t++)
+        {
+            __m256i& w = W[t & 15];
+            if (t < 16)
+                w = _mm256_load_si256(reinterpret_cast<const __m256i*>(M[t]));
+            else
+            {
+                const __m256i w2 = W[(t - 2) & 15], w15 = W[(t - 15) & 15];
+                const __m256i s1 = _mm256_xor_si256(_mm256_xor_si256(rotr4(w2, 19), rotr4(w2, 61)), _mm256_srli_epi64(w2, 6));
+                const __m256i s0 = _mm256_xor_si256(_mm256_xor_si256(rotr4(w15, 1), rotr4(w15, 8)), _mm256_srli_epi64(w15, 7));
+                w = _mm256_add_epi64(_mm256_add_epi64(s1, W[(t - 7) & 15]), _mm256_add_epi64(s0, w));
+            }
+
+            const __m256i S1 = _mm256_xor_si256(_mm256_xor_si256(rotr4(e, 14), rotr4(e, 18)), rotr4(e, 41));
+            const __m256i ch = _mm256_xor_si256(_mm256_and_si256(e, f), _mm256_andnot_si256(e, g));
+            const __m256i T1 = _mm256_add_epi64(_mm256_add_epi64(_mm256_add_epi64(h, S1), _mm256_add_epi64(ch, w)),
+                                                _mm256_set1_epi64x(static_cast<long long>(K512[t])));
+            const __m256i S0 = _mm256_xor_si256(_mm256_xor_si256(rotr4(a, 28), rotr4(a, 34)), rotr4(a, 39));
+            const __m256i maj = _mm256_xor_si256(_mm256_and_si256(a, b),
+                                                 _mm256_and_si256(c, _mm256_xor_si256(a, b)));
+            const __m256i T2 = _mm256_add_epi64(S0, maj);
+            h = g; g = f; f = e; e = _mm256_add_epi64(d, T1); d = c; c = b;
+            b = a; a = _mm256_add_epi64(T1, T2);
+        }
+
+        s[0] = _mm256_add_epi64(s[0], a); s[1] = _mm256_add_epi64(s[1], b);
+        s[2] = _mm256_add_epi64(s[2], c); s[3] = _mm256_add_epi64(s[3], d);
+        s[4] = _mm256_add_epi64(s[4], e); s[5] = _mm256_add_epi64(s[5], f);
+        s[6] = _mm256_add_epi64(s[6], g); s[7] = _mm256_add_epi64(s[7], h);
+    }
+
+    for (int i = 0; i < 8; i++)
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(state + 4 * i), s[i]);
+}
+#endif
+
+
+// Multi-digest:
+// Storage wants a SHA digest for content addressing and a CRC-32C for cheap
+// scrubbing, and computing them one after the other reads the data twice.
+// Instead the checksums asked for on the command line are fed from the same
+// buffers as the hasher, one slice at a time, so each slice is still in the
+// cache when the checksums get to it.
+struct Checksums
+{
+    std::optional<Crc32c> crc32c;
+    std::optional<Xxh64> xxh64;
+
+    bool any() const { return crc32c || xxh64; }
+
+    void update(const unsigned char* p, size_t len)
+    {
+        if (crc32c) crc32c->update(p, len);
+        if (xxh64) xxh64->update(p, len);
+    }
+
+    void print(const std::string& file) const
+    {
+        if (crc32c)
+            std::cout << "CRC32C (" << file << ") = " << std::setw(8) << std::setfill('0')
+                      << std::hex << crc32c->value() << std::endl;
+        if (xxh64)
+            std::cout << "XXH64 (" << file << ") = " << std::setw(16) << std::setfill('0')
+                      << std::hex << xxh64->value() << std::endl;
+    }
+};
+
+// The checksums selected on the command line. Each file gets a copy.
+static Checksums gChecksums;
+
+// Feeds a chunk to the hasher and the checksums.
+template <typename HasherT>
+void feed(HasherT& hasher, Checksums& sums, const unsigned char* p, size_t len)
+{
+    if (!sums.any())
+    {
+        hasher.update(p, len);
+        return;
+    }
+
+    const size_t slice = 32 * 1024;
+    for (size_t done = 0; done < len; done += slice)
+    {
+        const size_t n = std::min(slice, len - done);
+        hasher.update(p + done, n);
+        sums.update(p + done, n);
+    }
+}
+
+// Throttling:
+// Background sweeps on busy machines must not get in the way of the real
+// work. --max-rate BYTES caps the read bandwidth with a token bucket that
+// holds a tenth of a second's worth of bytes, --duty PERCENT has each thread
+// rest after every stretch of work so it is busy at most that share of the
+// time, and --idle puts the process in the idle I/O and CPU scheduling
+// classes where the system has them. Readers call pace() after every read;
+// the time spent sleeping there is reported at the end.
+class Throttle
+{
+public:
+    void setRate(uint64_t bytesPerSecond) { mRate = bytesPerSecond; mTokens = burst(); }
+    void setDuty(unsigned percent) { mDuty = std::clamp(percent, 1u, 100u); }
+    bool active() const { return mRate > 0 || mDuty < 100; }
+
+    // Accounts for bytes just read, and sleeps if the rate or the duty cycle
+    // calls for it.
+    void pace(uint64_t bytes)
+    {
+        mBytes += bytes;
+        if (!active())
+            return;
+
+        double wait = 0;
+        if (mRate > 0)
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            const double now = mClock.seconds();
+            mTokens = std::min(burst(), mTokens + (now - mLast) * mRate) - double(bytes);
+            mLast = now;
+            if (mTokens < 0)
+                wait = -mTokens / mRate;
+        }
+
+        // Each thread rests in proportion to how long it has been busy.
+        thread_local Stopwatch busy;
+        const double worked = busy.seconds();
+        if (mDuty < 100 && worked >= 0.01)
+            wait = std::max(wait, worked * (100 - mDuty) / mDuty);
+        else if (wait == 0)
+            return;
+
+        std::this_thread::sleep_for(std::chrono::duration<double>(wait));
+        mThrottled += uint64_t(wait * 1e9);
+        busy.restart();
+    }
+
+    // Prints what was read and how long was spent throttled, on destruction.
+    class Report
+    {
+    public:
+        explicit Report(Throttle& throttle) : mThrottle(throttle) {}
+        ~Report()
+        {
+            if (!mThrottle.active())
+                return;
+            const double seconds = mThrottle.mClock.seconds();
+            std::cout << std::dec << "Read " << mThrottle.mBytes << " bytes in " << std::fixed << std::setprecision(3)
+                      << seconds << " s, " << std::setprecision(1) << mThrottle.mBytes / seconds / 1e6
+                      << " MB/s, throttled " << std::setprecision(3) << mThrottle.mThrottled / 1e9
+                      << " s (summed over threads)" << std::endl;
+        }
+
+    private:
+        Throttle& mThrottle;
+    };
+
+private:
+    double burst() const { return std::max(mRate / 10.0, 65536.0); }
+
+    uint64_t mRate = 0;                 // Bytes per second, 0 for no limit
+    unsigned mDuty = 100;               // Percent of the time a thread may work
+    Stopwatch mClock;
+    std::mutex mMutex;
+    double mTokens = 0;
+    double mLast = 0;
+    std::atomic<uint64_t> mBytes = 0;
+    std::atomic<uint64_t> mThrottled = 0;   // Nanoseconds
+};
+
+static Throttle gThrottle;
+
+// Moves the process to the idle I/O scheduling class and the SCHED_IDLE CPU
+// policy, which later threads inherit. Linux only; returns false elsewhere
+// or if the system refuses.
+bool setIdlePriority()
+{
+#if defined(__linux__)
+    const int ioprioClassIdle = 3, ioprioClassShift = 13, ioprioWhoProcess = 1;
+    const bool io = ::syscall(SYS_ioprio_set, ioprioWhoProcess, 0, ioprioClassIdle << ioprioClassShift) == 0;
+    struct sched_param param = {};
+    const bool cpu = ::sched_setscheduler(0, SCHED_IDLE, &param) == 0;
+    return io && cpu;
+#else
+    return false;
+#endif
+}
+
+#if defined(__unix__) || defined(__APPLE__)
+// Asynchronous hashing with C++20 coroutines.
+//
+// asyncHash() reads a file or stream in chunks and hashes it on an EventLoop.
+// Reads are handed to a small pool of I/O threads so the loop thread never
+// blocks on the disk, and the compression yields back to the loop every few
+// blocks so one large upload cannot starve the others. A single threaded
+// server can run many of these at once and either call EventLoop::run(), or
+// watch EventLoop::fd() in its own poll/epoll loop and call runOnce() when it
+// becomes readable.
+
+// A lazily started coroutine returning a T. It is started by handing it to
+// EventLoop::spawn() or by co_await'ing it from another coroutine.
+template <typename T>
+class Task
+{
+public:
+    struct promise_type;
+    using handle = std::coroutine_handle<promise_type>;
+
+    struct promise_type
+    {
+        T value = {};
+        std::exception_ptr error;
+        std::coroutine_handle<> continuation;
+
+        Task get_return_object() { return Task(handle::from_promise(*this)); }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+
+        // When the task finishes, resume whoever was waiting on it.
+        struct FinalAwaiter
+        {
+            bool await_ready() noexcept { return false; }
+            std::coroutine_handle<> await_suspend(handle h) noexcept
+            {
+                if (h.promise().continuation)
+                    return h.promise().continuation;
+                return std::noop_coroutine();
+            }
+            void await_resume() noexcept {}
+        };
+        FinalAwaiter final_suspend() noexcept { return {}; }
+
+        void return_value(T v) { value = std::move(v); }
+        void unhandled_exception() { error = std::current_exception(); }
+    };
+
+    Task(Task&& other) noexcept : mHandle(std::exchange(other.mHandle, {})) {}
+    Task(const Task&) = delete;
+    Task& operator=(const Task&) = delete;
+    ~Task() { if (mHandle) mHandle.destroy(); }
+
+    bool done() const { return mHandle.done(); }
+    handle coroutine() const { return mHandle; }
+
+    // Returns the result of a finished task, rethrowing anything it threw.
+    T& result()
+    {
+        if (mHandle.promise().error)
+            std::rethrow_exception(mHandle.promise().error);
+        return mHandle.promise().value;
+    }
+
+    // Awaiting a task starts it and resumes the awaiter once it is done.
+    bool await_ready() const { return mHandle.done(); }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> waiter)
+    {
+        mHandle.promise().continuation = waiter;
+        return mHandle;
+    }
+    T& await_resume() { return result(); }
+
+private:
+    explicit Task(handle h) : mHandle(h) {}
+    handle mHandle;
+};
+
+class EventLoop
+{
+public:
+    explicit EventLoop(unsigned ioThreads = 2)
+    {
+        if (::pipe(mWake) != 0)
+            throw std::runtime_error("pipe failed");
+        ::fcntl(mWake[0], F_SETFL, O_NONBLOCK);
+        ::fcntl(mWake[1], F_SETFL, O_NONBLOCK);
+        for (unsigned i = 0; i < std::max(ioThreads, 1u); i++)
+            mWorkers.emplace_back([this] { ioWorker(); });
+    }
+
+    ~EventLoop()
+    {
+        {
+            std::lock_guard lock(mIoMutex);
+            mStopping = true;
+        }
+        mIoReady.notify_all();
+        for (auto& t : mWorkers) t.join();
+        ::close(mWake[0]);
+        ::close(mWake[1]);
+    }
+
+    // A descriptor that becomes readable whenever runOnce() has work to do.
+    int fd() const { return mWake[0]; }
+
+    // Starts a task on this loop. The caller keeps ownership of it.
+    template <typename T>
+    void spawn(Task<T>& task) { mReady.push_back(task.coroutine()); }
+
+    // Resumes everything that is ready without blocking.
+    void runOnce()
+    {
+        char drain[64];
+        while (::read(mWake[0], drain, sizeof(drain)) > 0) {}
+
+        {
+            std::lock_guard lock(mDoneMutex);
+            for (const auto& h : mCompleted) mReady.push_back(h);
+            mPending -= mCompleted.size();
+            mCompleted.clear();
+        }
+
+        // Only run what is queued now so a yielding task lets others in.
+        for (size_t n = mReady.size(); n > 0; n--)
+        {
+            const auto h = mReady.front();
+            mReady.pop_front();
+            h.resume();
+        }
+    }
+
+    // Runs until every spawned task has finished.
+    void run()
+    {
+        while (!mReady.empty() || mPending > 0)
+        {
+            runOnce();
+            if (mReady.empty() && mPending > 0)
+            {
+                pollfd p = { mWake[0], POLLIN, 0 };
+                ::poll(&p, 1, -1);
+            }
+        }
+    }
+
+    // co_await loop.yield() lets the other tasks on the loop run.
+    auto yield()
+    {
+        struct Awaiter
+        {
+            EventLoop& loop;
+            bool await_ready() { return false; }
+            void await_suspend(std::coroutine_handle<> h) { loop.mReady.push_back(h); }
+            void await_resume() {}
+        };
+        return Awaiter{ *this };
+    }
+
+    // co_await loop.read(fd, buf, len) reads on an I/O thread and resumes
+    // with the byte count, 0 at end of file, or -errno on error. errno itself
+    // belongs to the I/O thread and means nothing here.
+    auto read(int fd, unsigned char* buf, size_t len)
+    {
+        struct Awaiter
+        {
+            EventLoop& loop;
+            Request req;
+            bool await_ready() { return false; }
+            void await_suspend(std::coroutine_handle<> h)
+            {
+                req.waiter = h;
+                loop.submit(&req);
+            }
+            ssize_t await_resume() { return req.result; }
+        };
+        return Awaiter{ *this, Request{ fd, buf, len, 0, {} } };
+    }
+
+private:
+    struct Request
+    {
+        int fd;
+        unsigned char* buf;
+        size_t len;
+        ssize_t result = 0;
+        std::coroutine_handle<> waiter;
+    };
+
+    void submit(Request* req)
+    {
+        mPending++;
+        {
+            std::lock_guard lock(mIoMutex);
+            mRequests.push_back(req);
+        }
+        mIoReady.notify_one();
+    }
+
+    void ioWorker()
+    {
+        for (;;)
+        {
+            Request* req;
+            {
+                std::unique_lock lock(mIoMutex);
+                mIoReady.wait(lock, [this] { return mStopping || !mRequests.empty(); });
+                if (mRequests.empty())
+                    return;
+                req = mRequests.front();
+                mRequests.pop_front();
+            }
+
+            do {
+                req->result = ::read(req->fd, req->buf, req->len);
+            } while (req->result < 0 && errno == EINTR);
+            if (req->result < 0)
+                req->result = -errno;
+
+            {
+                std::lock_guard lock(mDoneMutex);
+                mCompleted.push_back(req->waiter);
+            }
+            const char c = 1;
+            (void)!::write(mWake[1], &c, 1);
+        }
+    }
+
+    int mWake[2] = { -1, -1 };
+    std::deque<std::coroutine_handle<>> mReady;
+    size_t mPending = 0;    // Reads submitted and not yet back on mReady
+
+    std::mutex mIoMutex;
+    std::condition_variable mIoReady;
+    std::deque<Request*> mRequests;
+    bool mStopping = false;
+    std::vector<std::thread> mWorkers;
+
+    std::mutex mDoneMutex;
+    std::vector<std::coroutine_handle<>> mCompleted;
+};
+
+// Hashes everything that can be read from fd. The descriptor can be a file,
+// a pipe or a socket; it is read sequentially and is not closed. Control goes
+// back to the loop after every read and every yieldBlocks blocks of hashing.
+Task<Digest> asyncHash(EventLoop& loop, int fd, size_t yieldBlocks = 256)
+{
+    Hasher hasher;
+    std::vector<unsigned char> buffer(1 << 20);
+
+    for (;;)
+    {
+        const ssize_t n = co_await loop.read(fd, buffer.data(), buffer.size());
+        if (n < 0)
+            throw std::runtime_error(std::string("read failed: ") + std::strerror(-n));
+        if (n == 0)
+            break;
+
+        const size_t slice = std::max<size_t>(yieldBlocks, 1) * 64;
+        for (size_t done = 0; done < size_t(n); done += slice)
+        {
+            hasher.update(buffer.data() + done, std::min(slice, size_t(n) - done));
+            co_await loop.yield();
+        }
+    }
+
+    co_return hasher.final();
+}
+
+Task<Digest> asyncHash(EventLoop& loop, std::string path, size_t yieldBlocks = 256)
+{
+    const int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        throw std::runtime_error(path + ": " + std::strerror(errno));
+
+    try {
+        Digest digest = co_await asyncHash(loop, fd, yieldBlocks);
+        ::close(fd);
+        co_return digest;
+    }
+    catch (...) {
+        ::close(fd);
+        throw;
+    }
+}
+#endif
+
+// Parses a byte count with an optional K, M or G suffix (powers of 1024).
+uint64_t parseBytes(const std::string& text)
+{
+    size_t end = 0;
+    uint64_t n = std::stoull(text, &end);
+    switch (end < text.size() ? std::toupper(static_cast<unsigned char>(text[end])) : 0)
+    {
+    case 'G': n <<= 10; [[fallthrough]];
+    case 'M': n <<= 10; [[fallthrough]];
+    case 'K': n <<= 10; break;
+    case 0: break;
+    default: throw std::invalid_argument(text + ": not a byte count");
+    }
+    return n;
+}
+
+// With -r, a directory argument stands for the regular files below it, in
+// sorted order so that two runs over the same tree list it the same way.
+// Symbolic links to directories are not followed.
+std::vector<std::pair<std::string, bool>> expandDirectories(const std::vector<std::pair<std::string, bool>>& args)
+{
+    namespace fs = std::filesystem;
+    std::vector<std::pair<std::string, bool>> files;
+    for (const auto& [arg, doublehash] : args)
+    {
+        std::error_code ec;
+        if (!fs::is_directory(arg, ec))
+        {
+            files.emplace_back(arg, doublehash);
+            continue;
+        }
+
+        std::vector<std::string> found;
+        fs::recursive_directory_iterator it(arg, fs::directory_options::skip_permission_denied, ec);
+        for (; !ec && it != fs::recursive_directory_iterator(); it.increment(ec))
+            if (it->is_regular_file(ec))
+                found.push_back(it->path().string());
+        if (ec)
+            std::cerr << arg << ": " << ec.message() << std::endl;
+
+        std::sort(found.begin(), found.end());
+        for (auto& file : found)
+            files.emplace_back(std::move(file), doublehash);
+    }
+    return files;
+}
+
+// This is just a simple utility function to parse the command line
+// arguments into a vector<string> type.
+std::vector<std::string> arguments(const int argc, char* argv[]) {
+    std::vector<std::string> res;
+
+    for (int i = 1; i < argc; i++)
+        res.emplace_back(argv[i]);
+
+    return res;
+}
+
+// One complete hash of a buffer with a particular kernel. Offload kernels
+// can fail, leaving no digest.
+std::optional<Digest> hashOnce(const Kernel& k, const unsigned char* p, size_t len)
+{
+    Digest digest = {};
+    if (k.compress)
+    {
+        Hasher hasher(k);
+        hasher.update(p, len);
+        digest = hasher.final();
+    }
+    else if (!k.hashBuffer(p, len, digest))
+        return std::nullopt;
+    return digest;
+}
+
+// Fills a benchmark buffer with something that is not all zeros.
+Message benchmarkData(size_t len)
+{
+    Message data(len);
+    for (size_t i = 0; i < data.size(); i++)
+        data[i] = static_cast<unsigned char>(i * 131 + (i >> 8));
+    return data;
+}
+
+// Tuning:
+// Which kernel is fastest depends on the CPU and on the message size, and how
+// many threads are worth running depends on the machine. --tune measures
+// these with short calibrated benchmarks and writes them to a per-host
+// profile which is loaded at startup and consulted by kernelFor().
+struct Profile
+{
+    // Messages up to first bytes long use kernel second. Increasing sizes.
+    std::vector<std::pair<uint64_t, const Kernel*>> crossovers;
+    unsigned threads = 0;   // 0 means one per usable CPU
+
+    // hashBatch() sends messages longer than lanesFrom and up to lanesUpTo
+    // bytes to the multi-buffer kernel lanesKernel. Null means use the
+    // defaults.
+    const Kernel* lanesKernel = nullptr;
+    uint64_t lanesFrom = 0;
+    uint64_t lanesUpTo = 0;
+};
+
+static Profile gProfile;
+
+// The kernel to use for a message of the given length.
+const Kernel& kernelFor(uint64_t len)
+{
+    if (!gKernelSelected)
+        for (const auto& [upTo, k] : gProfile.crossovers)
+            if (len <= upTo)
+                return *k;
+    return activeKernel();
+}
+
+// The number of CPUs the process may run on, which taskset or a container
+// can make fewer than the machine has.
+unsigned usableCpus()
+{
+#if defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (::sched_getaffinity(0, sizeof(set), &set) == 0 && CPU_COUNT(&set) > 0)
+        return CPU_COUNT(&set);
+#endif
+    return std::max(std::thread::hardware_concurrency(), 1u);
+}
+
+// The number of threads the profile recommends for parallel hashing, at most
+// one per usable CPU.
+unsigned tunedThreads()
+{
+    if (gProfile.threads > 0)
+        return std::min(gProfile.threads, usableCpus());
+    return usableCpus();
+}
+
+std::string hostName()
+{
+    char name[256] = {};
+#if defined(__unix__) || defined(__APPLE__)
+    ::gethostname(name, sizeof(name) - 1);
+#endif
+    return name[0] ? name : "localhost";
+}
+
+// $SHA256_PROFILE, or ~/.sha256-<host>.profile
+std::string profilePath()
+{
+    if (const char* path = std::getenv("SHA256_PROFILE"))
+        return path;
+    const char* home = std::getenv("HOME");
+    return std::string(home ? home : ".") + "/.sha256-" + hostName() + ".profile";
+}
+
+// Loads the profile if there is one. Kernels that are unknown or not
+// supported on this machine are skipped, so a stale profile is harmless.
+void loadProfile()
+{
+    std::ifstream in(profilePath());
+    std::string line;
+    while (std::getline(in, line))
+    {
+        std::istringstream fields(line);
+        std::string key;
+        fields >> key;
+        if (key == "kernel")
+        {
+            std::string upTo, name;
+            fields >> upTo >> name;
+            for (const auto& k : kernels())
+                if (name == k.name && k.supported())
+                    gProfile.crossovers.emplace_back(upTo == "max" ? UINT64_MAX : std::stoull(upTo), &k);
+        }
+        else if (key == "threads")
+            fields >> gProfile.threads;
+        else if (key == "lanes")
+        {
+            std::string name;
+            fields >> gProfile.lanesUpTo >> name >> gProfile.lanesFrom;
+            for (const auto& k : kernels())
+                if (name == k.name && k.compressLanes && k.supported())
+                    gProfile.lanesKernel = &k;
+        }
+    }
+}
+
+// Batch hashing:
+// hashBatch() hashes many independent messages that are already in memory.
+// Short messages cost about the same per block on any kernel, but a
+// multi-buffer kernel does several of them at once, while a long message is
+// best done by the fastest single stream kernel. So the batch is split by
+// size between the two and both engines run at the same time on their own
+// threads. The digests come back in the same order as the messages.
+using Span = std::span<const unsigned char>;
+
+// Multi-buffer scheduling for either family. Word and Bytes are the word
+// and block sizes, lanes() hashes blocks on all the lanes at once, single()
+// is a single stream compression and padding() returns the padding for a
+// message of the given length in bytes.
+template <typename Word, size_t Bytes>
+struct LaneEngine
+{
+    using State = std::array<Word, 8>;
+
+    unsigned width;
+    void (*lanes)(Word* state, const unsigned char* const* p, size_t blocks);
+    void (*single)(State& H, const unsigned char* p, size_t blocks);
+    Message (*padding)(uint64_t bytes);
+    const State& H0;
+};
+
+// Hashes the messages listed in order on a multi-buffer engine and stores
+// their digests in out. Each lane works through one message at a time, first
+// its whole blocks in place and then its padded tail, and picks up the next
+// message as soon as it is done. When too few messages are left to keep the
+// lanes busy (fewer than half, or only one) the stragglers are finished by
+// the single stream kernel.
+template <typename Word, size_t Bytes>
+void hashLanes(const LaneEngine<Word, Bytes>& k, const std::vector<Span>& messages,
+               const std::vector<size_t>& order, std::vector<std::array<Word, 8>>& out)
+{
+    using State = std::array<Word, 8>;
+
+    struct Lane
+    {
+        size_t index = SIZE_MAX;                // Message in this lane, SIZE_MAX if idle
+        const unsigned char* p = nullptr;       // Next block
+        size_t blocks = 0;                      // Blocks left at p
+        std::array<unsigned char, 2 * Bytes> tail;  // The last partial block plus padding
+        size_t tailBlocks = 0;                  // Tail blocks still to do after p
+    };
+
+    // Idle lanes hash zeros. Calls are limited to this many blocks so the
+    // zeros do not need to be as long as the longest message.
+    const size_t maxBlocks = 16;
+    static const std::array<unsigned char, Bytes * maxBlocks> idle = {};
+
+    const unsigned L = k.width;
+    std::vector<Lane> lanes(L);
+    std::vector<Word> state(8 * L);
+    std::vector<const unsigned char*> ptrs(L);
+    size_t next = 0, active = 0;
+
+    auto load = [&](unsigned l) {
+        Lane& lane = lanes[l];
+        lane.index = SIZE_MAX;
+        if (next == order.size())
+            return;
+        lane.index = order[next++];
+        active++;
+
+        const Span m = messages[lane.index];
+        const size_t rest = m.size() % Bytes;
+        const Message padding = k.padding(m.size());
+        std::copy_n(m.data() + (m.size() - rest), rest, lane.tail.begin());
+        std::copy(padding.begin(), padding.end(), lane.tail.begin() + rest);
+
+        lane.p = m.data();
+        lane.blocks = m.size() / Bytes;
+        lane.tailBlocks = (rest + padding.size()) / Bytes;
+        if (lane.blocks == 0)
+        {
+            lane.p = lane.tail.data();
+            lane.blocks = std::exchange(lane.tailBlocks, 0);
+        }
+        for (size_t w = 0; w < 8; w++)
+            state[w * L + l] = k.H0[w];
+    };
+
+    auto digestOf = [&](unsigned l) {
+        State H;
+        for (size_t w = 0; w < 8; w++)
+            H[w] = state[w * L + l];
+        return H;
+    };
+
+    for (unsigned l = 0; l < L; l++)
+        load(l);
+
+    while (active > 0)
+    {
+        if (next == order.size() && (active * 2 < L || active == 1))
+        {
+            for (unsigned l = 0; l < L; l++)
+            {
+                Lane& lane = lanes[l];
+                if (lane.index == SIZE_MAX)
+                    continue;
+                State H = digestOf(l);
+                k.single(H, lane.p, lane.blocks);
+                k.single(H, lane.tail.data(), lane.tailBlocks);
+                out[lane.index] = H;
+            }
+            return;
+        }
+
+        size_t n = maxBlocks;
+        for (unsigned l = 0; l < L; l++)
+        {
+            if (lanes[l].index != SIZE_MAX)
+                n = std::min(n, lanes[l].blocks);
+            ptrs[l] = lanes[l].index != SIZE_MAX ? lanes[l].p : idle.data();
+        }
+
+        k.lanes(state.data(), ptrs.data(), n);
+
+        for (unsigned l = 0; l < L; l++)
+        {
+            Lane& lane = lanes[l];
+            if (lane.index == SIZE_MAX)
+                continue;
+            lane.p += Bytes * n;
+            lane.blocks -= n;
+            if (lane.blocks > 0)
+                continue;
+
+            if (lane.tailBlocks > 0)
+            {
+                lane.p = lane.tail.data();
+                lane.blocks = std::exchange(lane.tailBlocks, 0);
+                continue;
+            }
+
+            out[lane.index] = digestOf(l);
+            active--;
+            load(l);
+        }
+    }
+}
+
+// The SHA-256 family engine for multi-buffer kernel k.
+LaneEngine<uint32_t, 64> laneEngine(const Kernel& k)
+{
+    const Kernel& single = activeKernel();
+    return { k.lanes, k.compressLanes, single.compress ? single.compress : compressScalar,
+             [](uint64_t bytes) { return pad(bytes * 8); }, activeVariant().H0 };
+}
+
+// The two lane kernel, which hashBatch() and the file pool use for pairs of
+// messages, if the machine has one and --kernel did not pin another.
+const Kernel* pairKernel()
+{
+    if (gKernelSelected)
+        return nullptr;
+    for (const auto& k : kernels())
+        if (k.lanes == 2 && k.supported())
+            return &k;
+    return nullptr;
+}
+
+// The multi-buffer kernel hashBatch() uses, and the messages it gets: those
+// longer than from and up to upTo bytes.
+struct LanesPlan
+{
+    const Kernel* kernel;
+    uint64_t from;
+    uint64_t upTo;
+};
+
+// Without a profile, the two lane kernel takes the messages over 1 KiB if
+// the machine has it; below that the single stream SHA extensions are
+// faster. Otherwise the widest supported multi-buffer kernel takes the
+// messages up to 1 KiB, unless the single stream kernel has SHA extensions,
+// which are faster at every size when there is only one core to share. A
+// kernel pinned with --kernel hashes everything.
+LanesPlan lanesPlan()
+{
+    if (gKernelSelected)
+        return { nullptr, 0, 0 };
+    if (gProfile.lanesKernel)
+        return { gProfile.lanesKernel, gProfile.lanesFrom, gProfile.lanesUpTo };
+
+    if (const Kernel* pair = pairKernel())
+        return { pair, 1024, UINT64_MAX };
+
+    const Kernel* widest = nullptr;
+    for (const auto& k : kernels())
+        if (k.compressLanes && k.supported() && (!widest || k.lanes > widest->lanes))
+            widest = &k;
+    const bool shani = std::string(activeKernel().name) == "shani";
+    return { widest, 0, widest && !(shani && tunedThreads() == 1) ? 1024u : 0u };
+}
+
+std::vector<Digest> hashBatch(const std::vector<Span>& messages, unsigned threads = 1)
+{
+    std::vector<Digest> out(messages.size());
+    const LanesPlan plan = lanesPlan();
+
+    std::vector<size_t> small, large;
+    uint64_t smallBytes = 0, totalBytes = 1;
+    for (size_t i = 0; i < messages.size(); i++)
+    {
+        totalBytes += messages[i].size();
+        if (plan.kernel && messages[i].size() > plan.from && messages[i].size() <= plan.upTo)
+        {
+            small.push_back(i);
+            smallBytes += messages[i].size();
+        }
+        else
+            large.push_back(i);
+    }
+
+    // Long messages are handed out one at a time to the single stream threads.
+    std::atomic<size_t> nextLarge = 0;
+    auto singles = [&] {
+        for (size_t i = nextLarge++; i < large.size(); i = nextLarge++)
+        {
+            const Span m = messages[large[i]];
+            const Kernel& kernel = kernelFor(m.size());
+            if (const std::optional<Digest> digest = hashOnce(kernel, m.data(), m.size()))
+                out[large[i]] = *digest;
+            else
+            {
+                // A failed offload kernel is replaced by the streaming code.
+                Hasher hasher(kernel);
+                hasher.update(m.data(), m.size());
+                out[large[i]] = hasher.final();
+            }
+        }
+    };
+
+    // Short messages are split into one contiguous slice per multi-buffer thread.
+    auto lanes = [&](unsigned slice, unsigned slices) {
+        const size_t first = small.size() * slice / slices;
+        const size_t last = small.size() * (slice + 1) / slices;
+        hashLanes(laneEngine(*plan.kernel), messages, { small.begin() + first, small.begin() + last }, out);
+    };
+
+    threads = std::max(threads, 1u);
+    if (threads == 1)
+    {
+        if (!small.empty()) lanes(0, 1);
+        singles();
+        return out;
+    }
+
+    // Share the threads in proportion to the bytes each engine has to do,
+    // giving each engine at least one if it has any work.
+    unsigned lanesThreads = small.empty() ? 0 : unsigned(threads * smallBytes / totalBytes);
+    lanesThreads = std::clamp(lanesThreads, small.empty() ? 0u : 1u, large.empty() ? threads : threads - 1);
+
+    std::vector<std::thread> pool;
+    for (unsigned t = 0; t < lanesThreads; t++)
+        pool.emplace_back(lanes, t, lanesThreads);
+    for (unsigned t = lanesThreads; t < threads; t++)
+        pool.emplace_back(singles);
+    for (auto& t : pool) t.join();
+    return out;
+}
+
+#if SHA256_X86
+// The SHA-512 family engine on the AVX2 four lane kernel.
+LaneEngine<uint64_t, 128> laneEngine512(const Variant512& variant = *gVariant512)
+{
+    return { 4, compress512Avx2x4, compress512, pad512, variant.H0 };
+}
+#endif
+
+// hashBatch() for the SHA-512 family. With AVX2 there is no single stream
+// kernel that beats the four lane one, so every message goes to the lanes,
+// split into one contiguous slice per thread.
+std::vector<Digest512> hashBatch512(const std::vector<Span>& messages, unsigned threads = 1)
+{
+    std::vector<Digest512> out(messages.size());
+    threads = std::clamp<unsigned>(threads, 1, std::max<size_t>(messages.size(), 1));
+
+    auto slice = [&](unsigned t) {
+        const size_t first = messages.size() * t / threads;
+        const size_t last = messages.size() * (t + 1) / threads;
+#if SHA256_X86
+        if (avx2Supported())
+        {
+            std::vector<size_t> order;
+            for (size_t i = first; i < last; i++) order.push_back(i);
+            hashLanes(laneEngine512(), messages, order, out);
+            return;
+        }
+#endif
+        for (size_t i = first; i < last; i++)
+        {
+            Hasher512 hasher;
+            hasher.update(messages[i].data(), messages[i].size());
+            out[i] = hasher.final();
+        }
+    };
+
+    std::vector<std::thread> pool;
+    for (unsigned t = 1; t < threads; t++)
+        pool.emplace_back(slice, t);
+    slice(0);
+    for (auto& t : pool) t.join();
+    return out;
+}
+
+// Bitcoin block files:
+// Bitcoin Core keeps the raw chain in blk*.dat files, each a run of records
+// of a 4 byte network magic, a 4 byte little endian length and a block. A
+// block is an 80 byte header, a transaction count and the transactions. The
+// txid is sha256d of a transaction without its segregated witness data (the
+// marker and flag after the version, and the witnesses before the lock
+// time), the wtxid that of the whole transaction. parseBlockFile() finds
+// every header and transaction in place; only the witness stripped copies of
+// segwit transactions are made, in one arena. hashBatch256d() then hashes
+// them all on the batch engine.
+struct ChainTx
+{
+    Span full;                  // The serialization the wtxid is taken over
+    Span stripped;              // The one the txid is taken over
+};
+
+struct ChainBlock
+{
+    Span header;
+    std::vector<ChainTx> txs;
+};
+
+// A bounds checked cursor over a block. Reading past the end clears ok and
+// yields nothing further.
+struct ChainReader
+{
+    const unsigned char* p;
+    const unsigned char* end;
+    bool ok = true;
+
+    const unsigned char* take(uint64_t n)
+    {
+        if (!ok || uint64_t(end - p) < n)
+        {
+            ok = false;
+            return nullptr;
+        }
+        const unsigned char* at = p;
+        p += n;
+        return at;
+    }
+
+    uint64_t little(size_t n)
+    {
+        const unsigned char* at = take(n);
+        uint64_t v = 0;
+        for (size_t i = n; at && i-- > 0;)
+            v = (v << 8) | at[i];
+        return v;
+    }
+
+    // CompactSize: below 0xfd the byte itself, else 2, 4 or 8 bytes follow.
+    uint64_t compactSize()
+    {
+        const uint64_t first = little(1);
+        return first < 0xfd ? first : little(size_t(2) << (first - 0xfd));
+    }
+};
+
+// Parses the blocks of a blk*.dat file image. Zero padding after the last
+// block ends the file. Returns false, with the blocks parsed so far, if the
+// file is damaged. arena holds the stripped transactions; it must outlive
+// the spans and is only appended to.
+bool parseBlockFile(Span file, std::vector<ChainBlock>& blocks, std::deque<Message>& arena)
+{
+    ChainReader records = { file.data(), file.data() + file.size() };
+    while (records.p < records.end)
+    {
+        const uint64_t magic = records.little(4);
+        if (magic == 0 && records.ok)
+            return true;
+        const uint64_t size = records.little(4);
+        const unsigned char* data = records.take(size);
+        if (!data)
+            return false;
+
+        ChainReader r = { data, data + size };
+        ChainBlock block;
+        if (const unsigned char* header = r.take(80))
+            block.header = Span(header, 80);
+        const uint64_t count = r.compactSize();
+        for (uint64_t t = 0; t < count && r.ok; t++)
+        {
+            const unsigned char* start = r.p;
+            r.take(4);
+            const bool segwit = r.ok && r.end - r.p >= 2 && r.p[0] == 0 && r.p[1] == 1;
+            if (segwit)
+                r.take(2);
+            const unsigned char* ioStart = r.p;
+            const uint64_t inputs = r.compactSize();
+            for (uint64_t i = 0; i < inputs && r.ok; i++)
+            {
+                r.take(36);
+                r.take(r.compactSize());
+                r.take(4);
+            }
+            const uint64_t outputs = r.compactSize();
+            for (uint64_t i = 0; i < outputs && r.ok; i++)
+            {
+                r.take(8);
+                r.take(r.compactSize());
+            }
+            const unsigned char* ioEnd = r.p;
+            for (uint64_t i = 0; segwit && i < inputs && r.ok; i++)
+            {
+                const uint64_t items = r.compactSize();
+                for (uint64_t k = 0; k < items && r.ok; k++)
+                    r.take(r.compactSize());
+            }
+            r.take(4);
+            if (!r.ok)
+                break;
+
+            ChainTx tx;
+            tx.full = Span(start, r.p - start);
+            tx.stripped = tx.full;
+            if (segwit)
+            {
+                Message& copy = arena.emplace_back(start, start + 4);
+                copy.insert(copy.end(), ioStart, ioEnd);
+                copy.insert(copy.end(), r.p - 4, r.p);
+                tx.stripped = Span(copy.data(), copy.size());
+            }
+            block.txs.push_back(tx);
+        }
+        if (!r.ok)
+            return false;
+        blocks.push_back(std::move(block));
+    }
+    return records.ok;
+}
+
+// sha256d of each message. The second round hashes the 32 byte digests of
+// the first, one block each, on the multi-buffer kernel as well rather than
+// one hashDigest() call at a time.
+std::vector<Digest> hashBatch256d(const std::vector<Span>& messages, unsigned threads = 1)
+{
+    const std::vector<Digest> first = hashBatch(messages, threads);
+    Message bytes(32 * first.size());
+    std::vector<Span> second;
+    for (size_t i = 0; i < first.size(); i++)
+    {
+        for (size_t w = 0; w < 8; w++)
+            for (size_t b = 0; b < 4; b++)
+                bytes[32 * i + 4 * w + b] = static_cast<unsigned char>(first[i][w] >> (24 - 8 * b));
+        second.emplace_back(bytes.data() + 32 * i, 32);
+    }
+    return hashBatch(second, threads);
+}
+
+// Bitcoin shows hashes as little endian numbers, so its hex runs backwards.
+std::string chainHex(const Digest& digest)
+{
+    std::ostringstream out;
+    for (size_t i = 32; i-- > 0;)
+        out << std::setw(2) << std::setfill('0') << std::hex << ((digest[i / 4] >> (24 - 8 * (i % 4))) & 0xff);
+    return out.str();
+}
+
+// Returns the throughput in bytes per second of run(data, reps), which hashes
+// data reps times, on the given number of threads. The repetition count is
+// first calibrated so one run takes about 20 ms, then the best of three runs
+// counts.
+template <typename Run>
+double throughput(const Message& data, Run run, unsigned threads = 1)
+{
+    size_t reps = 1;
+    for (Stopwatch sw; ; sw.restart())
+    {
+        run(data, reps);
+        if (sw.seconds() > 0.02)
+            break;
+        reps *= 2;
+    }
+
+    // Each thread hashes its own memory, copied before any timing starts.
+    const std::vector<Message> copies(threads, data);
+    double best = 0;
+    for (int trial = 0; trial < 3; trial++)
+    {
+        std::vector<std::thread> pool;
+        Stopwatch sw;
+        for (unsigned t = 0; t < threads; t++)
+            pool.emplace_back([&, t] { run(copies[t], reps); });
+        for (auto& t : pool) t.join();
+        best = std::max(best, double(reps) * data.size() * threads / sw.seconds());
+    }
+    return best;
+}
+
+// Splits d into count messages of len bytes each.
+std::vector<Span> splitBatch(const Message& d, size_t count, size_t len)
+{
+    std::vector<Span> batch;
+    for (size_t i = 0; i < count; i++)
+        batch.emplace_back(d.data() + i * len, len);
+    return batch;
+}
+
+// Returns the throughput of hashing len byte messages with kernel k on the
+// given number of threads, or 0 if the kernel fails. Every kernel hashes the
+// same batch of sixteen messages, so multi-buffer and single stream kernels
+// are compared on the same amount of memory.
+double measure(const Kernel& k, size_t len, unsigned threads = 1)
+{
+    const size_t count = 16;
+    std::atomic<bool> failed = false;
+
+    const double rate = throughput(benchmarkData(len * count), [&](const Message& d, size_t reps) {
+        const std::vector<Span> batch = splitBatch(d, count, len);
+        std::vector<size_t> order(count);
+        for (size_t i = 0; i < count; i++) order[i] = i;
+        std::vector<Digest> out(count);
+
+        for (size_t i = 0; i < reps; i++)
+        {
+            if (k.compressLanes)
+                hashLanes(laneEngine(k), batch, order, out);
+            else
+                for (size_t m = 0; m < count; m++)
+                    if (!hashOnce(k, batch[m].data(), len))
+                        failed = true;
+        }
+    }, threads);
+    return failed ? 0 : rate;
+}
+
+// Prints the throughput of every kernel over a range of message sizes, so the
+// kernels can be compared on this machine. The SHA-512 kernels are listed
+// last for comparison.
+void benchmark()
+{
+    const std::vector<size_t> sizes = { 64, 1024, 16 * 1024, 1024 * 1024 };
+
+    std::cout << std::left << std::setw(10) << "kernel";
+    for (const auto size : sizes)
+        std::cout << std::right << std::setw(12) << (std::to_string(size) + " B");
+    std::cout << "   (MB/s)" << std::endl;
+
+    for (const auto& k : kernels())
+    {
+        std::cout << std::left << std::setw(10) << k.name << std::right;
+        if (!k.supported())
+        {
+            std::cout << "  not supported on this machine" << std::endl;
+            continue;
+        }
+
+        for (const auto size : sizes)
+        {
+            const double rate = measure(k, size);
+            if (rate == 0)
+            {
+                std::cout << "  kernel failed";
+                break;
+            }
+            std::cout << std::setw(12) << std::fixed << std::setprecision(1) << rate / 1e6;
+        }
+        std::cout << std::endl;
+    }
+
+    std::cout << std::left << std::setw(10) << "sha512" << std::right;
+    for (const auto size : sizes)
+    {
+        const double rate = throughput(benchmarkData(size), [&](const Message& d, size_t reps) {
+            for (size_t i = 0; i < reps; i++)
+            {
+                Hasher512 hasher(variants512[0]);
+                hasher.update(d.data(), d.size());
+                hasher.final();
+            }
+        });
+        std::cout << std::setw(12) << std::fixed << std::setprecision(1) << rate / 1e6;
+    }
+    std::cout << std::endl;
+
+#if SHA256_X86
+    std::cout << std::left << std::setw(10) << "sha512x4" << std::right;
+    if (!avx2Supported())
+        std::cout << "  not supported on this machine";
+    else
+        for (const auto size : sizes)
+        {
+            const double rate = throughput(benchmarkData(size * 16), [&](const Message& d, size_t reps) {
+                const std::vector<Span> batch = splitBatch(d, 16, size);
+                std::vector<size_t> order(16);
+                for (size_t i = 0; i < order.size(); i++) order[i] = i;
+                std::vector<Digest512> out(16);
+                for (size_t i = 0; i < reps; i++)
+                    hashLanes(laneEngine512(variants512[0]), batch, order, out);
+            });
+            std::cout << std::setw(12) << std::fixed << std::setprecision(1) << rate / 1e6;
+        }
+    std::cout << std::endl;
+#endif
+}
+
+// Benchmarks every supported kernel over a range of message sizes, picks the
+// fastest single stream kernel for each size, the multi-buffer kernel and the
+// sizes up to which it beats them, and the smallest thread count that gets
+// within 5% of the best aggregate throughput, then saves the result.
+void tune()
+{
+    const std::vector<size_t> sizes = { 64, 256, 1024, 4096, 16384, 65536, 262144, 1048576 };
+
+    std::cout << "Tuning for " << hostName() << "\n\n"
+              << std::left << std::setw(10) << "bytes" << std::setw(10) << "kernel"
+              << std::setw(10) << "MB/s" << std::setw(10) << "lanes" << "MB/s"
+              << std::right << std::endl;
+
+    Profile profile;
+    const Kernel* firstLanes = nullptr;
+    bool lanesDone = false;
+    for (size_t i = 0; i < sizes.size(); i++)
+    {
+        const Kernel* best = nullptr;
+        const Kernel* bestLanes = nullptr;
+        double bestRate = 0, bestLanesRate = 0;
+        for (const auto& k : kernels())
+        {
+            if (!k.supported())
+                continue;
+            const double rate = measure(k, sizes[i]);
+            if (k.compressLanes)
+            {
+                if (rate > bestLanesRate) { bestLanes = &k; bestLanesRate = rate; }
+            }
+            else if (rate > bestRate) { best = &k; bestRate = rate; }
+        }
+
+        std::cout << std::left << std::setw(10) << sizes[i] << std::setw(10) << best->name
+                  << std::fixed << std::setprecision(1) << std::setw(10) << bestRate / 1e6
+                  << std::setw(10) << (bestLanes ? bestLanes->name : "-") << bestLanesRate / 1e6
+                  << std::right << std::endl;
+
+        // A multi-buffer kernel pays off over one run of sizes: the smallest
+        // for the wide kernels, the largest for the two lane one. A run
+        // reaching the largest size covers everything larger.
+        if (!firstLanes)
+            firstLanes = bestLanes;
+        const bool lanesWin = bestLanes && bestLanesRate > bestRate
+                              && (!profile.lanesKernel || bestLanes == profile.lanesKernel);
+        if (lanesWin && !lanesDone)
+        {
+            if (!profile.lanesKernel)
+            {
+                profile.lanesKernel = bestLanes;
+                profile.lanesFrom = i > 0 ? sizes[i - 1] : 0;
+            }
+            profile.lanesUpTo = i + 1 < sizes.size() ? sizes[i] : UINT64_MAX;
+        }
+        else if (profile.lanesKernel)
+            lanesDone = true;
+
+        // Neighbouring sizes with the same winner share one entry, and the
+        // last entry covers everything larger.
+        const uint64_t upTo = i + 1 < sizes.size() ? sizes[i] : UINT64_MAX;
+        if (!profile.crossovers.empty() && profile.crossovers.back().second == best)
+            profile.crossovers.back().first = upTo;
+        else
+            profile.crossovers.emplace_back(upTo, best);
+    }
+
+    // A multi-buffer kernel that never wins is recorded with nothing to do,
+    // so the defaults do not bring it back.
+    if (!profile.lanesKernel)
+        profile.lanesKernel = firstLanes;
+
+    const Kernel& bulk = *profile.crossovers.back().second;
+    const unsigned hw = usableCpus();
+    std::vector<std::pair<unsigned, double>> rates;
+    for (unsigned t = 1; t <= hw; t = t < hw && t * 2 > hw ? hw : t * 2)
+    {
+        rates.emplace_back(t, measure(bulk, 1 << 20, t));
+        std::cout << "threads " << std::setw(3) << t << "  " << rates.back().second / 1e6 << " MB/s" << std::endl;
+        if (t == hw) break;
+    }
+    double peak = 0;
+    for (const auto& [t, rate] : rates) peak = std::max(peak, rate);
+    for (const auto& [t, rate] : rates)
+        if (rate >= 0.95 * peak) { profile.threads = t; break; }
+
+    const std::string path = profilePath();
+    std::ofstream out(path);
+    out << "# sha256 tuning profile for " << hostName() << "\n";
+    for (const auto& [upTo, k] : profile.crossovers)
+        out << "kernel " << (upTo == UINT64_MAX ? std::string("max") : std::to_string(upTo))
+            << " " << k->name << "\n";
+    out << "threads " << profile.threads << "\n";
+    if (profile.lanesKernel)
+        out << "lanes " << profile.lanesUpTo << " " << profile.lanesKernel->name << " " << profile.lanesFrom << "\n";
+    if (!out)
+        throw std::runtime_error(path + ": cannot write profile");
+
+    std::cout << "\nProfile written to " << path << std::endl;
+}
+
+// Self test:
+// Before a fast kernel can be trusted it has to agree bit for bit with the
+// reference code, message() above, which is the plain FIPS 180-4 algorithm.
+// --selftest checks every supported kernel against it for every message
+// length from 0 to 4096 bytes and for some random large sizes, at several
+// misalignments of the input, with multi-buffer kernels fed ragged batches
+// of mixed lengths and full batches with a different tail in every lane. It
+// also checks the known answers from FIPS 180-4 and the NIST examples, and
+// runs the SHAVS Monte Carlo test from the CAVP SHA256Monte.rsp file on every
+// kernel. Whatever -a selected, the checks are of SHA-256.
+std::string toHex(const Digest& digest, size_t words = 8)
+{
+    std::ostringstream out;
+    for (size_t i = 0; i < words; i++)
+        out << std::setw(8) << std::setfill('0') << std::hex << digest[i];
+    return out.str();
+}
+
+std::string toHex(const Digest512& digest, size_t words = 8)
+{
+    std::ostringstream out;
+    for (size_t i = 0; i < words; i++)
+        out << std::setw(16) << std::setfill('0') << std::hex << digest[i];
+    return out.str();
+}
+
+int selftest()
+{
+    // The checks are of SHA-256, whatever -a selected.
+    const Variant* const selected = gVariant;
+    const Variant512* const selected512 = gVariant512;
+    gVariant = &variants[0];
+    gVariant512 = nullptr;
+
+    int checks = 0, failures = 0;
+    auto check = [&](bool ok, const std::string& what) {
+        checks++;
+        if (!ok)
+        {
+            failures++;
+            std::cout << "FAIL " << what << std::endl;
+        }
+    };
+
+    // The reference implementation. message() pads its argument in place.
+    auto reference = [](const unsigned char* p, size_t len) {
+        Message msg(p, p + len);
+        return message(msg);
+    };
+
+    std::mt19937_64 rng(180);
+    Message data(4 * 1024 * 1024 + 64);
+    for (auto& b : data)
+        b = static_cast<unsigned char>(rng());
+
+    // Messages at offset 0 of data, and where they are copied to for each
+    // misalignment. The same message is hashed at every alignment.
+    const size_t maxLen = 4096;
+    std::vector<Digest> expected(maxLen + 1);
+    for (size_t len = 0; len <= maxLen; len++)
+        expected[len] = reference(data.data(), len);
+    const size_t offsets[] = { 0, 1, 3, 7 };
+    Message shifted(maxLen + 8);
+
+    const std::vector<std::string> inputs = {
+        "", "abc",
+        "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq",
+        "abcdefghbcdefghicdefghijdefghijkefghijklfghijklmghijklmnhijklmnoijklmnopjklmnopqklmnopqrlmnopqrsmnopqrstnopqrstu",
+        std::string(1000000, 'a') };
+    const std::vector<std::pair<const char*, std::vector<std::string>>> answers = {
+        { "sha256", { "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855",
+                      "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad",
+                      "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1",
+                      "cf5b16a778af8380036ce59e7b0492370b249b11e8f07a51afac45037afee9d1",
+                      "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0" } },
+        { "sha224", { "d14a028c2a3a2bc9476102bb288234c415a2b01f828ea62ac5b3e42f",
+                      "23097d223405d8228642a477bda255b32aadbce4bda0b3f7e36c9da7",
+                      "75388b16512776cc5dba5da1fd890150b0c6455cb4f58b1952522525",
+                      "c97ca9a559850ce97a04a96def6d99a9e0e0e2ab14e6b8df265fc0b3",
+                      "20794655980c91d8bbb4c1ea97618a4bf03f42581948b2ee4ee7ad67" } },
+        { "sha512", { "cf83e1357eefb8bdf1542850d66d8007d620e4050b5715dc83f4a921d36ce9ce47d0d13c5d85f2b0ff8318d2877eec2f63b931bd47417a81a538327af927da3e",
+                      "ddaf35a193617abacc417349ae20413112e6fa4e89a97ea20a9eeee64b55d39a2192992a274fc1a836ba3c23a3feebbd454d4423643ce80e2a9ac94fa54ca49f",
+                      "204a8fc6dda82f0a0ced7beb8e08a41657c16ef468b228a8279be331a703c33596fd15c13b1b07f9aa1d3bea57789ca031ad85c7a71dd70354ec631238ca3445",
+                      "8e959b75dae313da8cf4f72814fc143f8f7779c6eb9f7fa17299aeadb6889018501d289e4900f7e4331b99dec4b5433ac7d329eeb6dd26545e96e55b874be909",
+                      "e718483d0ce769644e2e42c7bc15b4638e1f98b13b2044285632a803afa973ebde0ff244877ea60a4cb0432ce577c31beb009c5c2c49aa2e4eadb217ad8cc09b" } },
+        { "sha384", { "38b060a751ac96384cd9327eb1b1e36a21fdb71114be07434c0cc7bf63f6e1da274edebfe76f65fbd51ad2f14898b95b",
+                      "cb00753f45a35e8bb5a03d699ac65007272c32ab0eded1631a8b605a43ff5bed8086072ba1e7cc2358baeca134c825a7",
+                      "3391fdddfc8dc7393707a65b1b4709397cf8b1d162af05abfe8f450de5f36bc6b0455a8520bc4e6f5fe95b1fe3c8452b",
+                      "09330c33f71147e83d192fc782cd1b4753111b173b3b05d22fa08086e3b0f712fcc7c71a557e2db966c3e9fa91746039",
+                      "9d0e1809716474cb086e834e310a4a1ced149e9c00f248527972cec5704c2a5b07b8b3dc38ecc4ebae97ddd87f3d8985" } },
+        { "sha512/256", { "c672b8d1ef56ed28ab87c3622c5114069bdd3ad7b8f9737498d0c01ecef0967a",
+                          "53048e2681941ef99b2e29b76b4c7dabe4c2d0c634fc6d46e0e2f13107e7af23",
+                          "bde8e1f9f19bb9fd3406c90ec6bc47bd36d8ada9f11880dbc8a22a7078b6a461",
+                          "3928e184fb8690f840da3988121d31be65cb9d3ef83ee6146feac861e19b563a",
+                          "9a59a052930187a97038cae692f30708aa6491923ef5194394dc68d56c74fb21" } },
+    };
+
+    auto bytes = [](const std::string& s) { return reinterpret_cast<const unsigned char*>(s.data()); };
+
+    for (const auto& k : kernels())
+    {
+        if (!k.supported())
+        {
+            std::cout << k.name << ": not supported on this machine, skipped" << std::endl;
+            continue;
+        }
+        const int before = failures;
+
+        if (k.compressLanes)
+        {
+            // Every length, shuffled into batches of 1 to 3 times the lane
+            // count, each message at a random misalignment.
+            std::vector<size_t> lengths(maxLen + 1);
+            for (size_t i = 0; i < lengths.size(); i++) lengths[i] = i;
+            std::shuffle(lengths.begin(), lengths.end(), rng);
+
+            for (size_t first = 0; first < lengths.size(); )
+            {
+                const size_t count = std::min<size_t>(1 + rng() % (3 * k.lanes), lengths.size() - first);
+                std::vector<Message> copies;
+                std::vector<Span> batch;
+                std::vector<size_t> order;
+                for (size_t i = 0; i < count; i++)
+                {
+                    const size_t len = lengths[first + i], offset = offsets[rng() % 4];
+                    copies.emplace_back(offset + len);
+                    std::copy_n(data.begin(), len, copies.back().begin() + offset);
+                    order.push_back(i);
+                }
+                for (size_t i = 0; i < count; i++)
+                    batch.emplace_back(copies[i].data() + (copies[i].size() - lengths[first + i]), lengths[first + i]);
+
+                std::vector<Digest> out(count);
+                hashLanes(laneEngine(k), batch, order, out);
+                for (size_t i = 0; i < count; i++)
+                    check(out[i] == expected[lengths[first + i]],
+                          std::string(k.name) + " batch, length " + std::to_string(lengths[first + i]));
+                first += count;
+            }
+
+            // Full batches, one message per lane, with as many whole blocks
+            // in each lane but a different tail: half the lanes with a tail
+            // that needs a second padding block, so the lanes stay busy to
+            // the end and every tail goes through the multi-buffer kernel.
+            for (size_t round = 0; round < 24; round++)
+            {
+                std::vector<Span> batch;
+                std::vector<size_t> order;
+                for (size_t l = 0; l < k.lanes; l++)
+                {
+                    const size_t tail = l % 2 == 0 ? 56 + (round + l / 2) % 8 : (7 * round + 5 * l) % 56;
+                    batch.emplace_back(data.data(), 64 * (round % 3) + tail);
+                    order.push_back(l);
+                }
+                std::vector<Digest> out(batch.size());
+                hashLanes(laneEngine(k), batch, order, out);
+                for (size_t i = 0; i < batch.size(); i++)
+                    check(out[i] == expected[batch[i].size()],
+                          std::string(k.name) + " full batch, length " + std::to_string(batch[i].size()));
+            }
+
+            std::vector<Span> batch;
+            std::vector<size_t> order;
+            for (size_t i = 0; i < inputs.size(); i++)
+            {
+                batch.emplace_back(bytes(inputs[i]), inputs[i].size());
+                order.push_back(i);
+            }
+            std::vector<Digest> out(inputs.size());
+            hashLanes(laneEngine(k), batch, order, out);
+            for (size_t i = 0; i < inputs.size(); i++)
+                check(toHex(out[i]) == answers[0].second[i], std::string(k.name) + " known answer " + std::to_string(i));
+        }
+        else
+        {
+            for (const size_t offset : offsets)
+                for (size_t len = 0; len <= maxLen; len++)
+                {
+                    std::copy_n(data.begin(), len, shifted.begin() + offset);
+                    check(hashOnce(k, shifted.data() + offset, len) == expected[len],
+                          std::string(k.name) + " length " + std::to_string(len) + " offset " + std::to_string(offset));
+                }
+
+            for (int i = 0; i < 4; i++)
+            {
+                const size_t len = 65536 + rng() % (data.size() - 65536 - 8);
+                const size_t offset = rng() % 8;
+                check(hashOnce(k, data.data() + offset, len) == reference(data.data() + offset, len),
+                      std::string(k.name) + " random length " + std::to_string(len));
+            }
+
+            for (size_t i = 0; i < inputs.size(); i++)
+                check(toHex(hashOnce(k, bytes(inputs[i]), inputs[i].size()).value_or(Digest{})) == answers[0].second[i],
+                      std::string(k.name) + " known answer " + std::to_string(i));
+
+            // SHA-224 runs on the same kernels.
+            if (k.compress)
+                for (size_t i = 0; i < inputs.size(); i++)
+                {
+                    Hasher hasher(k, variants[1]);
+                    hasher.update(bytes(inputs[i]), inputs[i].size());
+                    check(toHex(hasher.final(), 7) == answers[1].second[i],
+                          std::string(k.name) + " SHA-224 known answer " + std::to_string(i));
+                }
+        }
+
+        std::cout << k.name << ": " << (failures == before ? "ok" : "FAILED") << std::endl;
+    }
+
+    // The SHAVS Monte Carlo test: each message is the previous three
+    // digests, and every 1000th digest seeds the next chain. The seed and the
+    // checkpoints are those of SHA256Monte.rsp. Multi-buffer kernels hash
+    // the same chain in all their lanes at once.
+    for (const auto& k : kernels())
+    {
+        if (!k.supported())
+            continue;
+        const int before = failures;
+        const unsigned width = k.compressLanes ? k.lanes : 1;
+        Digest seed = { 0x6d1e72ad, 0x03ddeb5d, 0xe891e572, 0xe2396f8d,
+                        0xa015d899, 0xef0e7950, 0x3152d601, 0x0a3fe691 };
+        std::vector<std::string> checkpoints;
+        for (int j = 0; j < 100; j++)
+        {
+            std::array<Digest, 3> md = { seed, seed, seed };
+            for (int i = 3; i < 1003; i++)
+            {
+                unsigned char m[96];
+                for (size_t w = 0; w < 24; w++)
+                {
+                    const uint32_t v = md[w / 8][w % 8];
+                    m[4 * w] = v >> 24; m[4 * w + 1] = v >> 16; m[4 * w + 2] = v >> 8; m[4 * w + 3] = v;
+                }
+                Digest next = {};
+                if (k.compressLanes)
+                {
+                    const std::vector<Span> batch(width, Span(m, sizeof(m)));
+                    std::vector<size_t> order(width);
+                    for (size_t l = 0; l < width; l++) order[l] = l;
+                    std::vector<Digest> out(width);
+                    hashLanes(laneEngine(k), batch, order, out);
+                    next = out[0];
+                    for (const Digest& d : out)
+                        if (d != next) next = {};
+                }
+                else
+                    next = hashOnce(k, m, sizeof(m)).value_or(Digest{});
+                md = { md[1], md[2], next };
+            }
+            seed = md[2];
+            checkpoints.push_back(toHex(seed));
+        }
+        check(checkpoints[0] == "e93c330ae5447738c8aa85d71a6c80f2a58381d05872d26bdd39f1fcd4f2b788",
+              std::string(k.name) + " Monte Carlo COUNT 0");
+        check(checkpoints[1] == "2e78f8c8772ea7c9331d41ed3f9cdf27d8f514a99342ee766ee3b8b0d0b121c0",
+              std::string(k.name) + " Monte Carlo COUNT 1");
+        check(checkpoints[99] == "6a912ba4188391a78e6f13d88ed2d14e13afce9db6f7dcbf4a48c24f3db02778",
+              std::string(k.name) + " Monte Carlo COUNT 99");
+        std::cout << "monte carlo (" << k.name << "): " << (failures == before ? "ok" : "FAILED") << std::endl;
+    }
+
+    // The shortcut for the holes in sparse files.
+    {
+        Digest zero = H0, scalar = H0;
+        compressZero(zero, 3);
+        compressScalar(scalar, gZeros.data(), 3);
+        check(zero == scalar, "zero blocks");
+    }
+
+    // sha256d one digest at a time and on the batch path, which pads the
+    // second round as an ordinary 32 byte message.
+    {
+        std::vector<Span> messages;
+        for (const size_t len : { 0, 32, 80, 1000 })
+            messages.emplace_back(data.data(), len);
+        const std::vector<Digest> batch = hashBatch256d(messages);
+        for (size_t i = 0; i < messages.size(); i++)
+            check(hashDigest(reference(messages[i].data(), messages[i].size())) == batch[i],
+                  "sha256d, length " + std::to_string(messages[i].size()));
+    }
+
+    // Tagged hashes against hashing the tag prefix with the message, for
+    // midstates worked out by the compiler and at run time.
+    {
+        const TaggedHasher runtime(std::string("TapLeaf"));
+        check(runtime.midstate() == kTapLeaf.midstate(), "tagged hash midstate");
+        const Digest tag = sha256Constexpr("BIP0340/challenge");
+        Message prefix;
+        for (int copy = 0; copy < 2; copy++)
+            for (size_t i = 0; i < 32; i++)
+                prefix.push_back(static_cast<unsigned char>(tag[i / 4] >> (24 - 8 * (i % 4))));
+        for (const size_t len : { 0, 32, 55, 64, 100, 1000 })
+        {
+            Hasher hasher;
+            hasher.update(prefix.data(), prefix.size());
+            hasher.update(data.data(), len);
+            check(kBip340Challenge(data.data(), len) == hasher.final(), "tagged hash, length " + std::to_string(len));
+        }
+    }
+
+    // The SHA-512 family: the scalar code against the known answers, and the
+    // four lane kernel against the scalar code.
+    {
+        const int before = failures;
+        for (size_t v = 0; v < variants512.size(); v++)
+            for (size_t i = 0; i < inputs.size(); i++)
+            {
+                Hasher512 hasher(variants512[v]);
+                hasher.update(bytes(inputs[i]), inputs[i].size());
+                check(toHex(hasher.final(), variants512[v].words) == answers[2 + v].second[i],
+                      std::string(variants512[v].name) + " known answer " + std::to_string(i));
+            }
+
+#if SHA256_X86
+        if (avx2Supported())
+        {
+            std::vector<Span> batch;
+            std::vector<size_t> order;
+            for (size_t len = 0; len <= maxLen; len += 1 + rng() % 7)
+            {
+                order.push_back(batch.size());
+                batch.emplace_back(data.data() + rng() % 8, len);
+            }
+            std::vector<Digest512> out(batch.size());
+            hashLanes(laneEngine512(variants512[0]), batch, order, out);
+            for (size_t i = 0; i < batch.size(); i++)
+            {
+                Hasher512 hasher(variants512[0]);
+                hasher.update(batch[i].data(), batch[i].size());
+                check(out[i] == hasher.final(), "sha512x4 batch, length " + std::to_string(batch[i].size()));
+            }
+        }
+#endif
+        std::cout << "sha512 family: " << (failures == before ? "ok" : "FAILED") << std::endl;
+    }
+
+    gVariant = selected;
+    gVariant512 = selected512;
+    std::cout << checks << " checks, " << failures << " failures" << std::endl;
+    return failures == 0 ? 0 : 1;
+}
+
+#ifdef SHA256_FUZZER
+// Fuzzing:
+// Built with -DSHA256_FUZZER and libFuzzer, for example
+//   clang++ -std=c++20 -O1 -g -fsanitize=fuzzer,address -DSHA256_FUZZER -o fuzz sha256.cpp
+// the program becomes a fuzz target instead of a command line tool. The first
+// byte of each input picks a target and the next eight seed the choice of
+// split points and lengths; the rest is the data. Split sizes are drawn to
+// land on the 55, 56, 63 and 64 byte boundaries where pad() changes shape.
+// Any disagreement with one-shot hashing aborts.
+namespace fuzz {
+
+void require(bool ok, const char* what)
+{
+    if (!ok)
+    {
+        std::cerr << "fuzz: " << what << " differs from one-shot hashing" << std::endl;
+        std::abort();
+    }
+}
+
+// The portable kernel, which the others are compared with.
+const Kernel& scalar()
+{
+    for (const auto& k : kernels())
+        if (std::string(k.name) == "scalar")
+            return k;
+    std::abort();
+}
+
+size_t pieceLength(std::mt19937_64& rng, size_t left)
+{
+    static const size_t edges[] = { 0, 1, 55, 56, 57, 63, 64, 65, 111, 112, 119, 120, 127, 128, 129 };
+    const size_t n = rng() % 2 ? edges[rng() % std::size(edges)] : rng() % 300;
+    return std::min(n, left);
+}
+
+// The same data through update() in random pieces and in one call.
+void streaming(std::mt19937_64& rng, const unsigned char* p, size_t len)
+{
+    std::vector<size_t> pieces;
+    for (size_t left = len; left > 0; )
+    {
+        pieces.push_back(pieceLength(rng, left));
+        left -= pieces.back();
+    }
+
+    auto split = [&](auto& hasher) {
+        size_t offset = 0;
+        for (const size_t n : pieces)
+        {
+            hasher.update(p + offset, n);
+            offset += n;
+        }
+        return hasher.final();
+    };
+
+    const Digest reference = *hashOnce(scalar(), p, len);
+    for (const auto& k : kernels())
+    {
+        if (!k.supported() || !k.compress)
+            continue;
+        Hasher hasher(k);
+        require(split(hasher) == reference, k.name);
+        Hasher hasher224(k, variants[1]);
+        Hasher whole224(scalar(), variants[1]);
+        whole224.update(p, len);
+        require(split(hasher224) == whole224.final(), "sha224");
+    }
+
+    for (const auto& variant : variants512)
+    {
+        Hasher512 hasher(variant), whole(variant);
+        whole.update(p, len);
+        require(split(hasher) == whole.final(), variant.name);
+    }
+
+    Crc32c crc, wholeCrc;
+    Xxh64 xxh, wholeXxh;
+    wholeCrc.update(p, len);
+    wholeXxh.update(p, len);
+    size_t offset = 0;
+    for (const size_t n : pieces)
+    {
+        crc.update(p + offset, n);
+        xxh.update(p + offset, n);
+        offset += n;
+    }
+    require(crc.value() == wholeCrc.value(), "crc32c");
+    require(xxh.value() == wholeXxh.value(), "xxh64");
+}
+
+// The data cut into a random mix of messages, through the batch engines.
+void batch(std::mt19937_64& rng, const unsigned char* p, size_t len)
+{
+    std::vector<Span> messages;
+    std::vector<size_t> order;
+    for (size_t offset = 0; offset < len || messages.size() < 2; )
+    {
+        const size_t n = rng() % 8 == 0 ? std::min<size_t>(rng() % 4096, len - offset) : pieceLength(rng, len - offset);
+        order.push_back(messages.size());
+        messages.emplace_back(p + offset, n);
+        offset += n;
+    }
+
+    std::vector<Digest> reference;
+    for (const Span m : messages)
+        reference.push_back(*hashOnce(scalar(), m.data(), m.size()));
+
+    require(hashBatch(messages, 1) == reference, "hashBatch");
+    require(hashBatch(messages, 3) == reference, "hashBatch on three threads");
+    for (const auto& k : kernels())
+    {
+        if (!k.supported() || !k.compressLanes)
+            continue;
+        std::vector<Digest> out(messages.size());
+        hashLanes(laneEngine(k), messages, order, out);
+        require(out == reference, k.name);
+    }
+
+#if SHA256_X86
+    if (avx2Supported())
+    {
+        std::vector<Digest512> out(messages.size());
+        hashLanes(laneEngine512(variants512[0]), messages, order, out);
+        for (size_t i = 0; i < messages.size(); i++)
+        {
+            Hasher512 hasher(variants512[0]);
+            hasher.update(messages[i].data(), messages[i].size());
+            require(out[i] == hasher.final(), "sha512x4");
+        }
+    }
+#endif
+}
+
+} // namespace fuzz
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size)
+{
+    if (size < 9)
+        return 0;
+    uint64_t seed = 0;
+    std::memcpy(&seed, data + 1, 8);
+    std::mt19937_64 rng(seed);
+
+    if (data[0] % 2 == 0)
+        fuzz::streaming(rng, data + 9, size - 9);
+    else
+        fuzz::batch(rng, data + 9, size - 9);
+    return 0;
+}
+#endif
+
+// Prints a digest in the same format as sha2 and friends.
+void printDigest(const std::string& file, const Digest& digest, bool doublehash)
+{
+    if (doublehash)
+        std::cout << " double hashed";
+
+    const Variant& variant = activeVariant();
+    std::cout << variant.label << " (" << file << ") = ";
+    for (size_t i = 0; i < variant.words; i++)
+        std::cout << std::setw(8) << std::setfill('0') << std::hex << digest[i];
+    std::cout << std::endl;
+}
+
+void printDigest512(const std::string& file, const Digest512& digest)
+{
+    std::cout << gVariant512->label << " (" << file << ") = ";
+    for (size_t i = 0; i < gVariant512->words; i++)
+        std::cout << std::setw(16) << std::setfill('0') << std::hex << digest[i];
+    std::cout << std::endl;
+}
+
+#if defined(__unix__) || defined(__APPLE__)
+// Hashes all the files at once on a single event loop thread and prints the
+// results in command line order.
+void hashFilesAsync(const std::vector<std::pair<std::string, bool>>& files)
+{
+    EventLoop loop;
+    std::vector<Task<Digest>> tasks;
+    tasks.reserve(files.size());
+
+    for (const auto& [file, doublehash] : files)
+    {
+        tasks.push_back(asyncHash(loop, file));
+        loop.spawn(tasks.back());
+    }
+
+    {
+        ExecutionTimer tm;
+        loop.run();
+    }
+
+    for (size_t i = 0; i < files.size(); i++)
+    {
+        try {
+            Digest digest = tasks[i].result();
+            if (files[i].second)
+                digest = hashDigest(digest);
+            printDigest(files[i].first, digest, files[i].second);
+        }
+        catch (const std::exception& e) {
+            std::cerr << e.what() << std::endl;
+        }
+    }
+}
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+// Page cache residency:
+// cachedBytes() says how much of a file is in the page cache, with the
+// cachestat() system call on Linux 6.5 and later, and otherwise by mapping
+// the file and asking mincore() which of its pages are resident, which
+// touches none of them.
+#if defined(__linux__) && !defined(__NR_cachestat)
+#define __NR_cachestat 451
+#endif
+#if defined(__APPLE__)
+using MincoreVector = char;
+#else
+using MincoreVector = unsigned char;
+#endif
+
+uint64_t cachedBytes(int fd, uint64_t size)
+{
+    if (size == 0)
+        return 0;
+    const uint64_t page = ::sysconf(_SC_PAGESIZE);
+
+#if defined(__linux__)
+    static std::atomic<bool> haveCachestat = true;
+    if (haveCachestat)
+    {
+        struct { uint64_t off, len; } range = { 0, 0 };     // To the end of the file
+        struct { uint64_t cache, dirty, writeback, evicted, recentlyEvicted; } stat = {};
+        if (::syscall(__NR_cachestat, fd, &range, &stat, 0) == 0)
+            return std::min(size, stat.cache * page);
+        if (errno == ENOSYS)
+            haveCachestat = false;
+    }
+#endif
+
+    // The file is mapped and queried a window at a time, so the residency
+    // vector stays at 256 KiB with 4 KiB pages however large the file is.
+    const uint64_t window = std::max<uint64_t>(page, 1 << 30) / page * page;
+    std::vector<MincoreVector> resident(window / page);
+    uint64_t pages = 0;
+    for (uint64_t offset = 0; offset < size; offset += window)
+    {
+        const size_t len = std::min(size - offset, window);
+        void* map = ::mmap(nullptr, len, PROT_READ, MAP_SHARED, fd, offset);
+        if (map == MAP_FAILED)
+            break;
+        if (::mincore(map, len, resident.data()) == 0)
+            for (size_t i = 0; i < (len + page - 1) / page; i++)
+                pages += resident[i] & 1;
+        ::munmap(map, len);
+    }
+    return std::min(size, pages * page);
+}
+#endif
+
+// Read order:
+// On spinning disks reading files in command line or directory order seeks
+// back and forth across the platters. With --physical-order the files are
+// read in the order of where their first extent lies on disk, found with the
+// FIEMAP ioctl. Files FIEMAP knows nothing about (other file systems, other
+// systems, empty files) keep their relative order after the rest.
+//
+// With --cached-first the files already wholly in the page cache are hashed
+// first, so the workers have work from the start, while the rest are read
+// ahead (see Prefetcher below) behind them.
+//
+// Either way the results are still reported in the order asked for.
+static bool gPhysicalOrder = false;
+static bool gCachedFirst = false;
+
+std::vector<size_t> readOrder(const std::vector<std::pair<std::string, bool>>& files)
+{
+    std::vector<size_t> order(files.size());
+    for (size_t i = 0; i < order.size(); i++)
+        order[i] = i;
+    if (!gPhysicalOrder && !gCachedFirst)
+        return order;
+
+    // Sorted by whether the file needs reading, then by device, then by
+    // physical offset on it.
+    std::vector<std::tuple<bool, uint64_t, uint64_t>> where(files.size(), { gCachedFirst, UINT64_MAX, UINT64_MAX });
+#if defined(__unix__) || defined(__APPLE__)
+    for (size_t i = 0; i < files.size(); i++)
+    {
+        const int fd = ::open(files[i].first.c_str(), O_RDONLY);
+        struct stat st = {};
+        if (fd < 0)
+            continue;
+        if (::fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+        {
+            ::close(fd);
+            continue;
+        }
+
+        if (gCachedFirst)
+            std::get<0>(where[i]) = cachedBytes(fd, st.st_size) < uint64_t(st.st_size);
+#if defined(__linux__)
+        alignas(struct fiemap) unsigned char request[sizeof(struct fiemap) + sizeof(struct fiemap_extent)] = {};
+        auto* map = reinterpret_cast<struct fiemap*>(request);
+        map->fm_length = FIEMAP_MAX_OFFSET;
+        map->fm_extent_count = 1;
+        if (gPhysicalOrder && ::ioctl(fd, FS_IOC_FIEMAP, map) == 0 && map->fm_mapped_extents > 0)
+        {
+            std::get<1>(where[i]) = st.st_dev;
+            std::get<2>(where[i]) = map->fm_extents[0].fe_physical;
+        }
+#endif
+        ::close(fd);
+    }
+#endif
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return where[a] < where[b]; });
+    return order;
+}
+
+#if defined(__unix__) || defined(__APPLE__)
+// Parallel hashing:
+// Files are hashed on a pool of worker threads. On NUMA machines reading a
+// file on one socket and hashing it on another costs a trip across the
+// interconnect for every byte, so the workers are spread over the NUMA nodes
+// and pinned to their node's CPUs, each worker allocates its own I/O buffer
+// after it is pinned (so first touch places it in local memory), and a file
+// is always read and hashed by the same worker.
+struct NumaNode
+{
+    int id;
+    std::vector<int> cpus;
+};
+
+// Parses a sysfs cpu list such as "0-3,8-11".
+std::vector<int> parseCpuList(const std::string& list)
+{
+    std::vector<int> cpus;
+    std::istringstream in(list);
+    std::string range;
+    while (std::getline(in, range, ','))
+    {
+        if (range.empty() || !std::isdigit(static_cast<unsigned char>(range[0])))
+            continue;
+        const size_t dash = range.find('-');
+        const int first = std::stoi(range);
+        const int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+        for (int cpu = first; cpu <= last; cpu++)
+            cpus.push_back(cpu);
+    }
+    return cpus;
+}
+
+// Discovers the NUMA nodes from /sys, each with only the CPUs the process
+// may already run on, so pinning never widens its affinity mask. Nodes left
+// without CPUs are dropped. Machines without NUMA (or without /sys), and
+// masks that leave no node, look like a single node with no CPU list, which
+// disables pinning.
+std::vector<NumaNode> numaTopology()
+{
+    std::vector<NumaNode> nodes;
+#if defined(__linux__)
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (::sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+        return { { 0, {} } };
+    for (int id = 0; ; id++)
+    {
+        std::ifstream in("/sys/devices/system/node/node" + std::to_string(id) + "/cpulist");
+        if (!in)
+        {
+            // Node ids can have gaps; the online list says how far to look.
+            std::ifstream online("/sys/devices/system/node/online");
+            std::string list;
+            std::getline(online, list);
+            const std::vector<int> ids = parseCpuList(list);
+            if (ids.empty() || id > ids.back())
+                break;
+            continue;
+        }
+        std::string list;
+        std::getline(in, list);
+        NumaNode node = { id, {} };
+        for (const int cpu : parseCpuList(list))
+            if (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed))
+                node.cpus.push_back(cpu);
+        if (!node.cpus.empty())
+            nodes.push_back(std::move(node));
+    }
+#endif
+    if (nodes.empty())
+        nodes.push_back({ 0, {} });
+    return nodes;
+}
+
+// Restricts the calling thread to the CPUs of one node.
+void pinToNode(const NumaNode& node)
+{
+#if defined(__linux__)
+    if (node.cpus.empty())
+        return;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (const int cpu : node.cpus)
+        if (cpu < CPU_SETSIZE)
+            CPU_SET(cpu, &set);
+    ::pthread_setaffinity_np(::pthread_self(), sizeof(set), &set);
+#else
+    (void)node;
+#endif
+}
+
+// Reads fd to the end through buffer and hashes what it reads.
+template <typename HasherT>
+bool hashStream(int fd, HasherT& hasher, Checksums& sums, Message& buffer,
+                uint64_t limit = UINT64_MAX)
+{
+    while (limit > 0)
+    {
+        const ssize_t n = ::read(fd, buffer.data(), std::min<uint64_t>(buffer.size(), limit));
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return false;
+        if (n == 0)
+            return true;
+        gThrottle.pace(n);
+        feed(hasher, sums, buffer.data(), n);
+        limit -= n;
+    }
+    return true;
+}
+
+// Sparse files:
+// A file whose allocated blocks cover less than its size has holes, which
+// read as zeros. hashSparse() asks the file system where the data is with
+// SEEK_DATA/SEEK_HOLE, reads only that, and hashes the holes from memory
+// with updateZeros(). The holes still have to go through the compression
+// function, since every block changes the state, but they cost no I/O.
+bool isSparse(const struct stat& st)
+{
+    return S_ISREG(st.st_mode) && uint64_t(st.st_blocks) * 512 < uint64_t(st.st_size);
+}
+
+template <typename HasherT>
+void feedZeros(HasherT& hasher, Checksums& sums, uint64_t len)
+{
+    hasher.updateZeros(len);
+    if (sums.any())
+        for (; len > 0; len -= std::min<uint64_t>(len, gZeros.size()))
+            sums.update(gZeros.data(), std::min<uint64_t>(len, gZeros.size()));
+}
+
+template <typename HasherT>
+bool hashSparse(int fd, uint64_t size, HasherT& hasher, Checksums& sums, Message& buffer)
+{
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+    for (off_t pos = 0; uint64_t(pos) < size; )
+    {
+        off_t data = ::lseek(fd, pos, SEEK_DATA);
+        if (data < 0 && errno == ENXIO)
+            data = size;    // Nothing but a hole to the end
+        else if (data < 0)
+        {
+            // No SEEK_DATA on this file system; read the rest.
+            if (::lseek(fd, pos, SEEK_SET) < 0)
+                return false;
+            return hashStream(fd, hasher, sums, buffer);
+        }
+        data = std::min<off_t>(data, size);
+        feedZeros(hasher, sums, data - pos);
+        if (uint64_t(data) == size)
+            break;
+
+        off_t hole = ::lseek(fd, data, SEEK_HOLE);
+        if (hole < 0 || ::lseek(fd, data, SEEK_SET) < 0)
+            return false;
+        hole = std::min<off_t>(hole, size);
+        if (!hashStream(fd, hasher, sums, buffer, hole - data))
+            return false;
+        pos = hole;
+    }
+    return true;
+#else
+    (void)size;
+    return hashStream(fd, hasher, sums, buffer);
+#endif
+}
+
+// Small files:
+// With many small files the system calls per file cost more than hashing
+// them. A regular file up to kSmallFile bytes is read with one pread() of one
+// byte more than fstat() reported, which also shows it has not grown since,
+// so it costs open, fstat, pread and close and nothing else. buffer is only
+// ever grown, so a caller can reuse it from file to file.
+constexpr uint64_t kSmallFile = 1 << 20;
+
+enum class SmallFile { Read, NotSmall, Failed };
+
+SmallFile readSmall(int fd, const struct stat& st, Message& buffer, size_t& len)
+{
+    if (!S_ISREG(st.st_mode) || uint64_t(st.st_size) > kSmallFile)
+        return SmallFile::NotSmall;
+    if (buffer.size() < size_t(st.st_size) + 1)
+        buffer.resize(st.st_size + 1);
+
+    ssize_t n;
+    do
+        n = ::pread(fd, buffer.data(), st.st_size + 1, 0);
+    while (n < 0 && errno == EINTR);
+    if (n < 0)
+        return SmallFile::Failed;
+    // A file that grew is read again in full, and only that read is paced.
+    if (n > st.st_size)
+        return SmallFile::NotSmall;
+    gThrottle.pace(n);
+    len = n;
+    return SmallFile::Read;
+}
+
+// Readahead:
+// While one file is hashed the kernel knows nothing of the ones after it, so
+// on disks and network file systems every file starts with a wait. With
+// --readahead BYTES the files are announced with POSIX_FADV_WILLNEED as they
+// come within BYTES of the file being hashed, so their reads overlap the
+// hashing of the ones before, and each file the run brought into the page
+// cache is dropped with POSIX_FADV_DONTNEED once it is done, so a large run
+// does not push everything else out of memory. Files that were wholly cached
+// before the run are left there. Only the part of a file not already in the
+// page cache counts against the budget. Systems without posix_fadvise()
+// (macOS) ignore the option.
+static uint64_t gReadahead = 0;     // Byte budget, 0 for no readahead
+
+class Prefetcher
+{
+public:
+    // Files are dropped from the cache after use only if drop is set.
+    Prefetcher(const std::vector<std::pair<std::string, bool>>& files, uint64_t budget, bool drop = true)
+        : mFiles(files), mSizes(files.size()), mSeen(files.size()), mBudget(budget), mDrop(drop) {}
+
+    // Called as file i is taken up for hashing, from any thread. The files
+    // are opened and advised outside the lock, so one thread's slow open does
+    // not hold up the others.
+    void claim(size_t i)
+    {
+        if (mBudget == 0)
+            return;
+        std::unique_lock<std::mutex> lock(mMutex);
+
+        // Files reached before they were announced are read on demand.
+        while (mNext < mFiles.size() && (mNext <= i || mAdvised - mClaimed < mBudget))
+        {
+            const size_t j = mNext++;
+            lock.unlock();
+            const uint64_t uncached = visit(j, j <= i ? Advice::None : Advice::WillNeed);
+            lock.lock();
+            mSizes[j] = uncached;
+            mSeen[j] = true;
+            mAdvised += uncached;
+            mVisited.notify_all();
+        }
+
+        // Another thread may still be looking at file i.
+        mVisited.wait(lock, [&] { return bool(mSeen[i]); });
+        mClaimed += mSizes[i];
+    }
+
+    // Called once file i has been hashed.
+    void release(size_t i)
+    {
+        if (mBudget == 0 || !mDrop)
+            return;
+        bool warmed;
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            warmed = mSeen[i] && mSizes[i] > 0;
+        }
+        if (warmed)
+            visit(i, Advice::DontNeed);
+    }
+
+    // Drops a file from the page cache, whoever brought it there.
+    static void evict(const std::string& file)
+    {
+#if defined(POSIX_FADV_DONTNEED)
+        const int fd = ::open(file.c_str(), O_RDONLY);
+        if (fd < 0)
+            return;
+        ::posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        ::close(fd);
+#endif
+    }
+
+    // Claims file i for its lifetime.
+    class Claim
+    {
+    public:
+        Claim(Prefetcher& prefetch, size_t i) : mPrefetch(prefetch), mIndex(i) { prefetch.claim(i); }
+        ~Claim() { mPrefetch.release(mIndex); }
+
+    private:
+        Prefetcher& mPrefetch;
+        size_t mIndex;
+    };
+
+private:
+    enum class Advice { None, WillNeed, DontNeed };
+
+    // Gives the kernel advice on the whole of file i and returns how much of
+    // it was not in the page cache.
+    uint64_t visit(size_t i, Advice advice) const
+    {
+        if (advice == Advice::DontNeed)
+        {
+            evict(mFiles[i].first);
+            return 0;
+        }
+        const int fd = ::open(mFiles[i].first.c_str(), O_RDONLY);
+        if (fd < 0)
+            return 0;
+        struct stat st = {};
+        uint64_t uncached = 0;
+        if (::fstat(fd, &st) == 0 && S_ISREG(st.st_mode))
+            uncached = st.st_size - cachedBytes(fd, st.st_size);
+#if defined(POSIX_FADV_WILLNEED)
+        if (advice == Advice::WillNeed && uncached > 0)
+            ::posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+#endif
+        ::close(fd);
+        return uncached;
+    }
+
+    const std::vector<std::pair<std::string, bool>>& mFiles;
+    std::vector<uint64_t> mSizes;   // Bytes not in the page cache when first seen
+    std::vector<char> mSeen;        // Whether mSizes has been filled in
+    const uint64_t mBudget;
+    const bool mDrop;
+    std::mutex mMutex;
+    std::condition_variable mVisited;
+    size_t mNext = 0;           // First file not yet announced
+    uint64_t mAdvised = 0;      // Bytes announced, including files already claimed
+    uint64_t mClaimed = 0;      // Bytes of the files taken up so far
+};
+
+// The readahead for a pool or batch run: the --readahead budget, or with
+// --cached-first alone 64 MiB to warm the files behind the cached ones,
+// without dropping anything afterwards.
+uint64_t readaheadBudget()
+{
+    return gReadahead ? gReadahead : gCachedFirst ? 64 << 20 : 0;
+}
+
+struct FileResult
+{
+    Digest digest = {};
+    Digest512 digest512 = {};   // Used instead of digest for the SHA-512 family
+    Checksums sums = gChecksums;
+    std::string error;          // Empty if the file was hashed
+};
+
+// Journal:
+// A scan of millions of files takes hours, and a run that is killed would
+// otherwise start over. With --journal FILE the pool appends a line for each
+// file it hashes,
+//     <algorithm> <size> <mtime in ns> <digest> <path>
+// and a background thread writes and syncs the lines once a second, so a
+// crash loses about a second's work. A file that is deleted or moved away
+// while --watch runs gets a tombstone line, "- 0 0 - <path>", which cancels
+// the records before it. With --resume the journal is loaded first, and
+// files whose size and modification time match their record are reported
+// from it instead of being read again. A journal holding superseded
+// records, tombstones or a torn last line is then rewritten with only the
+// live records, so one that is resumed again and again does not keep
+// growing.
+class Journal
+{
+public:
+    ~Journal()
+    {
+        if (mFd < 0)
+            return;
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mStopping = true;
+        }
+        mStop.notify_all();
+        if (mFlusher.joinable())
+            mFlusher.join();
+        flush();
+        ::close(mFd);
+    }
+
+    bool enabled() const { return mFd >= 0; }
+
+    // Opens the journal, loading the records already in it when resuming.
+    // Returns false with errno set if it cannot be opened.
+    bool open(const std::string& path, bool resume)
+    {
+        if (resume && !load(path))
+            return false;
+        mFd = ::open(path.c_str(), O_RDWR | O_CREAT | O_APPEND | (resume ? 0 : O_TRUNC), 0644);
+        if (mFd < 0)
+            return false;
+
+        mFlusher = std::thread([this] {
+            std::unique_lock<std::mutex> lock(mMutex);
+            while (!mStop.wait_for(lock, std::chrono::seconds(1), [this] { return mStopping; }))
+            {
+                lock.unlock();
+                flush();
+                lock.lock();
+            }
+        });
+        return true;
+    }
+
+    // Stats a file and, if the journal has a record of it as it is now,
+    // fills in its digest and returns true. The stat is kept for record().
+    bool recall(const std::pair<std::string, bool>& file, struct stat& st, FileResult& result) const
+    {
+        if (mFd < 0 || ::stat(file.first.c_str(), &st) != 0)
+            return false;
+        const auto found = mRecords.find(file.first);
+        if (found == mRecords.end())
+            return false;
+        const Record& record = found->second;
+        if (record.algorithm != algorithm(file.second) || record.size != uint64_t(st.st_size)
+            || record.mtime != mtime(st))
+            return false;
+        return gVariant512 ? fromHex(record.digest, result.digest512) : fromHex(record.digest, result.digest);
+    }
+
+    // Appends the record of a file hashed after recall() missed it.
+    void record(const std::pair<std::string, bool>& file, const struct stat& st, const FileResult& result)
+    {
+        if (mFd < 0 || !S_ISREG(st.st_mode) || !result.error.empty()
+            || file.first.find('\n') != std::string::npos)
+            return;
+
+        std::ostringstream line;
+        line << algorithm(file.second) << ' ' << st.st_size << ' ' << mtime(st) << ' '
+             << (gVariant512 ? toHex(result.digest512, gVariant512->words) : toHex(result.digest, activeVariant().words))
+             << ' ' << file.first << '\n';
+
+        bool full;
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mPending += line.str();
+            full = mPending.size() >= (1 << 20);
+        }
+        if (full)
+            flush();
+    }
+
+    // Appends a tombstone for a file that no longer exists.
+    void forget(const std::string& file)
+    {
+        if (mFd < 0 || file.find('\n') != std::string::npos)
+            return;
+        mRecords.erase(file);
+        std::lock_guard<std::mutex> lock(mMutex);
+        mPending += "- 0 0 - " + file + "\n";
+    }
+
+    // The files with a record loaded by --resume.
+    std::vector<std::string> recorded() const
+    {
+        std::vector<std::string> files;
+        for (const auto& record : mRecords)
+            files.push_back(record.first);
+        return files;
+    }
+
+    // Writes and syncs the records appended so far.
+    void sync()
+    {
+        if (mFd >= 0)
+            flush();
+    }
+
+private:
+    struct Record
+    {
+        std::string algorithm;
+        uint64_t size = 0;
+        int64_t mtime = 0;
+        std::string digest;
+    };
+
+    // Loads the live records of a journal, and if it holds anything else
+    // replaces it with a copy holding only those. A missing journal is an
+    // empty one. Returns false with errno set if the copy cannot be made.
+    bool load(const std::string& path)
+    {
+        std::ifstream in(path, std::ios::binary);
+        std::string line;
+        size_t lines = 0;
+        while (std::getline(in, line) && !in.eof())
+        {
+            lines++;
+            std::istringstream fields(line);
+            Record record;
+            std::string file;
+            if (!(fields >> record.algorithm >> record.size >> record.mtime >> record.digest
+                  && fields.get() == ' ' && std::getline(fields, file)))
+                continue;
+            if (record.algorithm == "-")
+                mRecords.erase(file);
+            else
+                mRecords[file] = std::move(record);
+        }
+        const bool torn = !line.empty();
+        if (lines == mRecords.size() && !torn)
+            return true;
+
+        const std::string temporary = path + ".tmp";
+        const int fd = ::open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0)
+            return false;
+        std::string live;
+        for (const auto& [file, record] : mRecords)
+            live += record.algorithm + ' ' + std::to_string(record.size) + ' ' + std::to_string(record.mtime)
+                    + ' ' + record.digest + ' ' + file + '\n';
+        bool ok = true;
+        for (size_t done = 0; ok && done < live.size();)
+        {
+            const ssize_t n = ::write(fd, live.data() + done, live.size() - done);
+            if (n < 0 && errno == EINTR)
+                continue;
+            ok = n > 0;
+            done += ok ? n : 0;
+        }
+        ok = ok && ::fsync(fd) == 0;
+        ::close(fd);
+        if (ok && ::rename(temporary.c_str(), path.c_str()) == 0)
+            return true;
+        const int error = errno;
+        ::unlink(temporary.c_str());
+        errno = error;
+        return false;
+    }
+
+    static std::string algorithm(bool doublehash)
+    {
+        return std::string(gVariant512 ? gVariant512->name : activeVariant().name) + (doublehash ? "d" : "");
+    }
+
+    static int64_t mtime(const struct stat& st)
+    {
+#if defined(__APPLE__)
+        return int64_t(st.st_mtimespec.tv_sec) * 1000000000 + st.st_mtimespec.tv_nsec;
+#else
+        return int64_t(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+#endif
+    }
+
+    template <typename Word, size_t N>
+    static bool fromHex(const std::string& hex, std::array<Word, N>& digest)
+    {
+        const size_t digits = 2 * sizeof(Word);
+        if (hex.size() % digits != 0 || hex.size() / digits > N)
+            return false;
+        for (size_t i = 0; i < hex.size() / digits; i++)
+            digest[i] = Word(std::stoull(hex.substr(i * digits, digits), nullptr, 16));
+        return true;
+    }
+
+    // Writes the pending lines and syncs them to disk. The lines are taken
+    // under mMutex, so record() is not held up by the disk, and written under
+    // mWriteMutex, so flushes from different threads stay in order.
+    void flush()
+    {
+        std::lock_guard<std::mutex> write(mWriteMutex);
+        std::string pending;
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            pending.swap(mPending);
+        }
+        if (pending.empty())
+            return;
+        for (size_t done = 0; done < pending.size();)
+        {
+            const ssize_t n = ::write(mFd, pending.data() + done, pending.size() - done);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0)
+            {
+                std::cerr << "journal: " << std::strerror(errno) << std::endl;
+                break;
+            }
+            done += n;
+        }
+        ::fsync(mFd);
+    }
+
+    int mFd = -1;
+    std::unordered_map<std::string, Record> mRecords;   // Loaded by --resume
+    std::mutex mMutex;
+    std::string mPending;       // Lines not yet written
+    std::mutex mWriteMutex;     // Held while writing and syncing
+    std::thread mFlusher;
+    std::condition_variable mStop;
+    bool mStopping = false;     // Set under mMutex to stop mFlusher
+};
+
+static Journal gJournal;
+
+// Hashes one file the caller has opened and fstat'ed, using the worker's
+// buffer. fd is left open.
+FileResult hashFile(const std::string& file, int fd, const struct stat& st, Message& buffer)
+{
+    FileResult result;
+    const Kernel& kernel = kernelFor(st.st_size);
+    const bool sparse = isSparse(st);
+    // Offload kernels read the file themselves, out of the throttle's reach.
+    const bool offload = kernel.hashFd && !result.sums.any() && !gThrottle.active();
+    size_t len = 0;
+    SmallFile small = SmallFile::NotSmall;
+    if (!offload)
+        small = readSmall(fd, st, buffer, len);
+    auto read = [&](auto& hasher) {
+        if (small == SmallFile::Read)
+        {
+            feed(hasher, result.sums, buffer.data(), len);
+            return true;
+        }
+        if (small == SmallFile::Failed)
+            return false;
+        return sparse ? hashSparse(fd, st.st_size, hasher, result.sums, buffer)
+                      : hashStream(fd, hasher, result.sums, buffer);
+    };
+
+    bool ok;
+    if (gVariant512)
+    {
+        Hasher512 hasher;
+        ok = read(hasher);
+        result.digest512 = hasher.final();
+    }
+    else if (offload && !sparse)
+        ok = kernel.hashFd(fd, result.digest);
+    else
+    {
+        Hasher hasher(kernel);
+        ok = read(hasher);
+        result.digest = hasher.final();
+    }
+    if (!ok)
+        result.error = file + ": " + std::strerror(errno);
+    return result;
+}
+
+// Opens and hashes one file using the worker's buffer.
+FileResult hashFile(const std::string& file, Message& buffer)
+{
+    const int fd = ::open(file.c_str(), O_RDONLY);
+    struct stat st = {};
+    if (fd < 0 || ::fstat(fd, &st) != 0)
+    {
+        FileResult result;
+        result.error = file + ": " + std::strerror(errno);
+        if (fd >= 0)
+            ::close(fd);
+        return result;
+    }
+    FileResult result = hashFile(file, fd, st, buffer);
+    ::close(fd);
+    return result;
+}
+
+// Hashes two files at once on the two lane kernel. Each file is read a buffer
+// at a time; the whole blocks both buffers hold are hashed together and the
+// rest is kept for the next round. Once one file is finished the other one
+// carries on with the single stream kernel.
+std::pair<FileResult, FileResult> hashFilePair(const std::string& fileA, const std::string& fileB,
+                                               Message& bufferA, Message& bufferB)
+{
+    struct Stream
+    {
+        Stream(const std::string& file, Message& buffer) : file(file), buffer(buffer) {}
+
+        const std::string& file;
+        Message& buffer;
+        int fd = -1;
+        uint64_t size = 0;      // From fstat(), for picking its kernel
+        size_t have = 0;        // Bytes in buffer
+        uint64_t length = 0;    // Bytes read so far
+        bool eof = false;
+        FileResult result;
+    };
+    std::array<Stream, 2> streams = { Stream(fileA, bufferA), Stream(fileB, bufferB) };
+
+    struct stat st = {};
+    for (auto& s : streams)
+    {
+        s.fd = ::open(s.file.c_str(), O_RDONLY);
+        if (s.fd < 0 || ::fstat(s.fd, &st) != 0 || !S_ISREG(st.st_mode) ||
+            st.st_size < 65536 || isSparse(st) || !kernelFor(st.st_size).compress)
+        {
+            // Not a pair after all.
+            for (auto& t : streams)
+                if (t.fd >= 0) ::close(t.fd);
+            return { hashFile(fileA, bufferA), hashFile(fileB, bufferB) };
+        }
+        s.size = st.st_size;
+    }
+
+    auto fill = [](Stream& s) {
+        while (!s.eof && s.have < s.buffer.size())
+        {
+            const ssize_t n = ::read(s.fd, s.buffer.data() + s.have, s.buffer.size() - s.have);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0)
+                s.result.error = s.file + ": " + std::strerror(errno);
+            if (n <= 0)
+            {
+                s.eof = true;
+                break;
+            }
+            gThrottle.pace(n);
+            s.have += n;
+            s.length += n;
+        }
+    };
+
+    // Drops the first blocks whole blocks from a stream's buffer.
+    auto consume = [](Stream& s, size_t blocks) {
+        std::memmove(s.buffer.data(), s.buffer.data() + 64 * blocks, s.have - 64 * blocks);
+        s.have -= 64 * blocks;
+    };
+
+    // Hashes a stream's remaining bytes and padding into H, on the single
+    // stream kernel for its size.
+    auto finish = [&](Stream& s, Digest& H) {
+        const Kernel& single = kernelFor(s.size);
+        single.compress(H, s.buffer.data(), s.have / 64);
+        consume(s, s.have / 64);
+        Message tail(s.buffer.begin(), s.buffer.begin() + s.have);
+        const Message padding = pad(s.length * 8);
+        tail.insert(tail.end(), padding.begin(), padding.end());
+        single.compress(H, tail.data(), tail.size() / 64);
+        s.result.digest = H;
+    };
+
+    const Kernel& pair = *pairKernel();
+    std::array<uint32_t, 16> state;
+    for (size_t w = 0; w < 8; w++)
+        state[2 * w] = state[2 * w + 1] = activeVariant().H0[w];
+    auto digestOf = [&](unsigned l) {
+        Digest H;
+        for (size_t w = 0; w < 8; w++)
+            H[w] = state[2 * w + l];
+        return H;
+    };
+
+    // Both together while both have whole blocks to hash.
+    for (;;)
+    {
+        fill(streams[0]);
+        fill(streams[1]);
+        const size_t blocks = std::min(streams[0].have, streams[1].have) / 64;
+        if (blocks == 0)
+            break;
+        const unsigned char* p[2] = { streams[0].buffer.data(), streams[1].buffer.data() };
+        pair.compressLanes(state.data(), p, blocks);
+        consume(streams[0], blocks);
+        consume(streams[1], blocks);
+    }
+
+    // At least one stream has less than a block left, so it is at the end.
+    const unsigned done = streams[0].have < 64 ? 0 : 1;
+    Digest H = digestOf(done);
+    finish(streams[done], H);
+
+    Stream& rest = streams[1 - done];
+    const Kernel& single = kernelFor(rest.size);
+    H = digestOf(1 - done);
+    while (!rest.eof)
+    {
+        single.compress(H, rest.buffer.data(), rest.have / 64);
+        consume(rest, rest.have / 64);
+        fill(rest);
+    }
+    finish(rest, H);
+
+    for (auto& s : streams)
+        ::close(s.fd);
+    return { std::move(streams[0].result), std::move(streams[1].result) };
+}
+
+// Hashes the files on threads workers, returning the results in the order
+// of files.
+std::vector<FileResult> hashFilesPool(const std::vector<std::pair<std::string, bool>>& files, unsigned threads)
+{
+    const std::vector<NumaNode> nodes = numaTopology();
+    std::vector<FileResult> results(files.size());
+    std::atomic<size_t> next = 0;
+    const bool pairs = pairKernel() && !gVariant512 && !gChecksums.any();
+
+    // The files in the order they are read, which the prefetcher follows.
+    const std::vector<size_t> order = readOrder(files);
+    std::vector<std::pair<std::string, bool>> queue;
+    for (const size_t i : order)
+        queue.push_back(files[i]);
+    Prefetcher prefetch(queue, readaheadBudget(), gReadahead > 0);
+
+    {
+        ExecutionTimer tm;
+        std::vector<std::thread> pool;
+        threads = std::max(1u, std::min<unsigned>(threads, files.size()));
+        for (unsigned t = 0; t < threads; t++)
+        {
+            pool.emplace_back([&, t] {
+                pinToNode(nodes[t % nodes.size()]);
+                Message buffer(1 << 20), second;
+
+                // Double hashes a file's digest as needed and journals it.
+                auto finish = [&](size_t i, const struct stat& st) {
+                    if (files[i].second)
+                        results[i].digest = hashDigest(results[i].digest);
+                    gJournal.record(files[i], st, results[i]);
+                };
+
+                for (size_t k = next++; k < files.size(); k = next++)
+                {
+                    // While there are plenty of files left for the other
+                    // workers, take two at a time for the two lane kernel.
+                    const size_t l = pairs && files.size() - k >= 2 * threads ? next++ : SIZE_MAX;
+                    const size_t i = order[k];
+                    const size_t j = l < files.size() ? order[l] : SIZE_MAX;
+                    prefetch.claim(k);
+                    if (j != SIZE_MAX)
+                        prefetch.claim(l);
+
+                    // Files the journal has an up to date record of are
+                    // not read again.
+                    struct stat sti = {}, stj = {};
+                    const bool hashI = !gJournal.recall(files[i], sti, results[i]);
+                    const bool hashJ = j != SIZE_MAX && !gJournal.recall(files[j], stj, results[j]);
+                    if (hashI && hashJ)
+                    {
+                        second.resize(buffer.size());
+                        std::tie(results[i], results[j]) = hashFilePair(files[i].first, files[j].first, buffer, second);
+                    }
+                    else
+                    {
+                        if (hashI)
+                            results[i] = hashFile(files[i].first, buffer);
+                        if (hashJ)
+                            results[j] = hashFile(files[j].first, buffer);
+                    }
+                    if (hashI)
+                        finish(i, sti);
+                    if (hashJ)
+                        finish(j, stj);
+
+                    if (j != SIZE_MAX)
+                        prefetch.release(l);
+                    prefetch.release(k);
+                }
+            });
+        }
+        for (auto& t : pool) t.join();
+    }
+    return results;
+}
+
+// Hashes the files on threads workers and prints the results in command
+// line order.
+void hashFilesParallel(const std::vector<std::pair<std::string, bool>>& files, unsigned threads)
+{
+    const std::vector<FileResult> results = hashFilesPool(files, threads);
+    for (size_t i = 0; i < files.size(); i++)
+    {
+        if (!results[i].error.empty())
+        {
+            std::cerr << results[i].error << std::endl;
+            continue;
+        }
+        if (gVariant512)
+            printDigest512(files[i].first, results[i].digest512);
+        else
+            printDigest(files[i].first, results[i].digest, files[i].second);
+        results[i].sums.print(files[i].first);
+    }
+}
+
+// Compares reading and hashing the files from a cold cache one after the
+// other without and with readahead (the --readahead budget, or 64 MiB). The
+// files are dropped from the page cache before each run with
+// POSIX_FADV_DONTNEED, which needs no privileges but only drops clean pages
+// and cannot reach the caches of a disk or a file server.
+void benchmarkReadahead(const std::vector<std::pair<std::string, bool>>& files)
+{
+    uint64_t bytes = 0;
+    for (const auto& file : files)
+    {
+        struct stat st = {};
+        if (::stat(file.first.c_str(), &st) == 0 && S_ISREG(st.st_mode))
+            bytes += st.st_size;
+    }
+
+    for (const uint64_t budget : { uint64_t(0), gReadahead ? gReadahead : 64 << 20 })
+    {
+        for (const auto& file : files)
+            Prefetcher::evict(file.first);
+
+        Stopwatch sw;
+        Prefetcher prefetch(files, budget);
+        Message buffer(1 << 20);
+        for (size_t i = 0; i < files.size(); i++)
+        {
+            const Prefetcher::Claim claim(prefetch, i);
+            hashFile(files[i].first, buffer);
+        }
+        const double seconds = sw.seconds();
+
+        std::cout << "readahead " << std::left << std::setw(10)
+                  << (budget ? std::to_string(budget >> 20) + " MiB" : std::string("off")) << std::right
+                  << std::fixed << std::setprecision(1) << std::setw(10) << bytes / seconds / 1e6 << " MB/s"
+                  << std::setprecision(3) << std::setw(10) << seconds << " s" << std::endl;
+    }
+}
+
+// Tree digests:
+// --tree prints one digest for each directory argument, so that two copies
+// of a release tree can be compared without shipping a manifest. A directory
+// is hashed as the list of its entries sorted bytewise by name, each entry
+// being
+//     <mode in octal> ' ' <name> '\0' <digest>
+// where the mode is st_mode with its file type bits (100644, 40755 ...; all
+// symbolic links are 120000) and the digest, in binary, is that of the
+// file's contents, the link's target or the subdirectory. Other kinds of
+// files are left out with a warning. The files are hashed by the pool, then
+// the directories are combined a level at a time from the deepest up, the
+// directories of a level in parallel.
+struct TreeNode
+{
+    std::string path;
+    std::string name;
+    mode_t mode = 0;
+    size_t depth = 0;
+    std::vector<size_t> children;   // Sorted by name
+    Digest digest = {};
+};
+
+// Lists the tree below root breadth first into nodes, root first. Returns
+// false, having reported why, if any of it cannot be read.
+bool scanTree(const std::string& root, std::vector<TreeNode>& nodes)
+{
+    struct stat st = {};
+    if (::stat(root.c_str(), &st) != 0)
+    {
+        std::cerr << root << ": " << std::strerror(errno) << std::endl;
+        return false;
+    }
+    if (!S_ISDIR(st.st_mode))
+    {
+        std::cerr << root << ": not a directory" << std::endl;
+        return false;
+    }
+    nodes.push_back({ root, "", st.st_mode, 0, {}, {} });
+
+    for (size_t n = 0; n < nodes.size(); n++)
+    {
+        if (!S_ISDIR(nodes[n].mode))
+            continue;
+        DIR* dir = ::opendir(nodes[n].path.c_str());
+        if (!dir)
+        {
+            std::cerr << nodes[n].path << ": " << std::strerror(errno) << std::endl;
+            return false;
+        }
+        std::vector<std::string> names;
+        while (const dirent* entry = ::readdir(dir))
+            if (std::strcmp(entry->d_name, ".") != 0 && std::strcmp(entry->d_name, "..") != 0)
+                names.emplace_back(entry->d_name);
+        ::closedir(dir);
+        std::sort(names.begin(), names.end());
+
+        for (std::string& name : names)
+        {
+            const std::string path = nodes[n].path + "/" + name;
+            if (::lstat(path.c_str(), &st) != 0)
+            {
+                std::cerr << path << ": " << std::strerror(errno) << std::endl;
+                return false;
+            }
+            if (!S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode) && !S_ISLNK(st.st_mode))
+            {
+                std::cerr << path << ": not a file, directory or link, left out" << std::endl;
+                continue;
+            }
+            nodes[n].children.push_back(nodes.size());
+            nodes.push_back({ path, std::move(name), S_ISLNK(st.st_mode) ? mode_t(S_IFLNK) : st.st_mode,
+                              nodes[n].depth + 1, {}, {} });
+        }
+    }
+    return true;
+}
+
+// Computes the digest of the tree below root on threads workers.
+bool hashTree(const std::string& root, unsigned threads, Digest& digest)
+{
+    std::vector<TreeNode> nodes;
+    if (!scanTree(root, nodes))
+        return false;
+
+    // Files go to the pool; links are hashed here, they are short.
+    std::vector<std::pair<std::string, bool>> files;
+    std::vector<size_t> fileNodes;
+    std::vector<std::vector<size_t>> levels;
+    for (size_t n = 0; n < nodes.size(); n++)
+    {
+        TreeNode& node = nodes[n];
+        if (S_ISREG(node.mode))
+        {
+            files.emplace_back(node.path, false);
+            fileNodes.push_back(n);
+        }
+        else if (S_ISLNK(node.mode))
+        {
+            std::vector<char> target(PATH_MAX);
+            const ssize_t len = ::readlink(node.path.c_str(), target.data(), target.size());
+            if (len < 0)
+            {
+                std::cerr << node.path << ": " << std::strerror(errno) << std::endl;
+                return false;
+            }
+            Hasher hasher;
+            hasher.update(reinterpret_cast<const unsigned char*>(target.data()), len);
+            node.digest = hasher.final();
+        }
+        else
+        {
+            levels.resize(std::max(levels.size(), node.depth + 1));
+            levels[node.depth].push_back(n);
+        }
+    }
+
+    const std::vector<FileResult> results = hashFilesPool(files, threads);
+    bool ok = true;
+    for (size_t i = 0; i < files.size(); i++)
+    {
+        if (!results[i].error.empty())
+            std::cerr << results[i].error << std::endl;
+        ok = ok && results[i].error.empty();
+        nodes[fileNodes[i]].digest = results[i].digest;
+    }
+    if (!ok)
+        return false;
+
+    const size_t words = activeVariant().words;
+    auto combine = [&](TreeNode& dir) {
+        Hasher hasher;
+        for (const size_t c : dir.children)
+        {
+            const TreeNode& child = nodes[c];
+            std::ostringstream entry;
+            entry << std::oct << child.mode << ' ' << child.name << '\0';
+            for (size_t w = 0; w < words; w++)
+                for (int shift = 24; shift >= 0; shift -= 8)
+                    entry << char(child.digest[w] >> shift);
+            const std::string bytes = entry.str();
+            hasher.update(reinterpret_cast<const unsigned char*>(bytes.data()), bytes.size());
+        }
+        dir.digest = hasher.final();
+    };
+
+    // A level's directories only depend on the level below. Combining one
+    // is quick, so small levels are done on this thread.
+    for (auto level = levels.rbegin(); level != levels.rend(); ++level)
+    {
+        std::atomic<size_t> next = 0;
+        auto work = [&] {
+            for (size_t k = next++; k < level->size(); k = next++)
+                combine(nodes[(*level)[k]]);
+        };
+        std::vector<std::thread> pool;
+        const size_t workers = std::min<size_t>(threads, level->size() / 64 + 1);
+        for (size_t t = 1; t < workers; t++)
+            pool.emplace_back(work);
+        work();
+        for (auto& t : pool) t.join();
+    }
+
+    digest = nodes[0].digest;
+    return true;
+}
+
+#if defined(__linux__)
+// Watching:
+// --watch hashes the files below each directory argument once and then keeps
+// them fresh: it stays running and rehashes only the files that inotify
+// reports as written and closed or moved in, instead of rereading the whole
+// tree on a schedule. Bursts of writes are coalesced: the changed paths are
+// collected until 200 ms pass without an event, or 2 s since the first, then
+// hashed by the pool as one batch. With --journal the digests are appended to
+// the journal as well, which then serves as a persistent index, and with
+// --resume a restart skips the unchanged files in the initial scan. Files
+// deleted or moved out of the tree, while watching or while it was not
+// running, get tombstones in the journal so the index forgets them. (fanotify
+// would need CAP_SYS_ADMIN, so inotify watches each directory instead.)
+// Runs until SIGINT or SIGTERM, letting the journal flush on the way out.
+static volatile std::sig_atomic_t gStop = 0;
+
+int watchTrees(const std::vector<std::pair<std::string, bool>>& roots, unsigned threads)
+{
+    const int fd = ::inotify_init1(IN_CLOEXEC);
+    if (fd < 0)
+    {
+        std::cerr << "inotify: " << std::strerror(errno) << std::endl;
+        return 1;
+    }
+
+    struct sigaction action = {};
+    action.sa_handler = [](int) { gStop = 1; };
+    ::sigaction(SIGINT, &action, nullptr);
+    ::sigaction(SIGTERM, &action, nullptr);
+
+    std::unordered_map<int, std::string> dirs;      // By watch descriptor
+    std::map<std::string, bool> changed;            // Path to double hashing
+    std::set<std::string> known;                    // Files hashed so far
+
+    // Watches a directory and those below it, and adds the files in them to
+    // changed. Watching first means nothing written meanwhile is missed.
+    auto add = [&](const std::string& root, bool doublehash) {
+        namespace fs = std::filesystem;
+        auto watch = [&](const std::string& dir) {
+            const int wd = ::inotify_add_watch(fd, dir.c_str(),
+                                               IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_DELETE | IN_MOVED_FROM
+                                               | IN_DELETE_SELF | IN_ONLYDIR | IN_DONT_FOLLOW);
+            if (wd < 0)
+                std::cerr << dir << ": " << std::strerror(errno) << std::endl;
+            else
+                dirs[wd] = dir;
+        };
+        watch(root);
+        std::error_code ec;
+        fs::recursive_directory_iterator it(root, fs::directory_options::skip_permission_denied, ec);
+        for (; !ec && it != fs::recursive_directory_iterator(); it.increment(ec))
+        {
+            if (it->is_symlink(ec))
+                continue;
+            if (it->is_directory(ec))
+                watch(it->path().string());
+            else if (it->is_regular_file(ec))
+                changed.emplace(it->path().string(), doublehash);
+        }
+        if (ec)
+            std::cerr << root << ": " << ec.message() << std::endl;
+    };
+
+    // Hashes the changed files that still exist.
+    auto flush = [&] {
+        std::vector<std::pair<std::string, bool>> files;
+        struct stat st = {};
+        for (const auto& file : changed)
+            if (::stat(file.first.c_str(), &st) == 0 && S_ISREG(st.st_mode))
+            {
+                files.push_back(file);
+                known.insert(file.first);
+            }
+        changed.clear();
+        if (files.empty())
+            return;
+        hashFilesParallel(files, threads);
+        gJournal.sync();
+    };
+
+    // Tombstones a file that is gone, or every file known below a directory
+    // that is.
+    auto forget = [&](const std::string& path) {
+        for (auto it = known.lower_bound(path); it != known.end() && it->compare(0, path.size(), path) == 0;)
+        {
+            if (it->size() != path.size() && (*it)[path.size()] != '/')
+            {
+                ++it;
+                continue;
+            }
+            gJournal.forget(*it);
+            it = known.erase(it);
+        }
+    };
+
+    for (const auto& [root, doublehash] : roots)
+        add(root, doublehash);
+    flush();
+
+    // Records of files under the roots that went while nobody was watching.
+    for (const std::string& file : gJournal.recorded())
+        for (const auto& root : roots)
+            if (file.compare(0, root.first.size() + 1, root.first + "/") == 0 && !known.count(file))
+                gJournal.forget(file);
+    gJournal.sync();
+
+    Stopwatch sinceFirst, sinceLast;
+    alignas(inotify_event) char events[64 << 10];
+    while (!gStop)
+    {
+        int timeout = -1;
+        if (!changed.empty())
+            timeout = std::max(0, int(1000 * std::min(0.2 - sinceLast.seconds(), 2.0 - sinceFirst.seconds())));
+        pollfd p = { fd, POLLIN, 0 };
+        const int ready = ::poll(&p, 1, timeout);
+        if (ready < 0 && errno == EINTR)
+            continue;
+        if (ready < 0)
+        {
+            std::cerr << "poll: " << std::strerror(errno) << std::endl;
+            break;
+        }
+        if (ready == 0)
+        {
+            flush();
+            continue;
+        }
+
+        const ssize_t len = ::read(fd, events, sizeof(events));
+        if (len <= 0)
+            continue;
+        if (changed.empty())
+            sinceFirst.restart();
+        sinceLast.restart();
+        for (ssize_t off = 0; off < len;)
+        {
+            const inotify_event* event = reinterpret_cast<const inotify_event*>(events + off);
+            off += sizeof(inotify_event) + event->len;
+
+            // Events were lost, so everything is hashed again.
+            if (event->mask & IN_Q_OVERFLOW)
+            {
+                for (const auto& [root, doublehash] : roots)
+                    add(root, doublehash);
+                continue;
+            }
+            if (event->mask & IN_IGNORED)
+            {
+                dirs.erase(event->wd);
+                continue;
+            }
+            const auto dir = dirs.find(event->wd);
+            if (dir == dirs.end())
+                continue;
+            if (event->mask & IN_DELETE_SELF)
+            {
+                forget(dir->second);
+                continue;
+            }
+            if (event->len == 0)
+                continue;
+
+            // A file takes double hashing from the argument it is under.
+            const std::string path = dir->second + "/" + event->name;
+            bool doublehash = false;
+            for (const auto& root : roots)
+                if (path.compare(0, root.first.size() + 1, root.first + "/") == 0)
+                    doublehash = root.second;
+
+            if (event->mask & (IN_DELETE | IN_MOVED_FROM))
+            {
+                changed.erase(path);
+                forget(path);
+            }
+            else if (event->mask & IN_ISDIR)
+            {
+                if (event->mask & (IN_CREATE | IN_MOVED_TO))
+                    add(path, doublehash);
+            }
+            else if (event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO))
+                changed.emplace(path, doublehash);
+        }
+    }
+
+    ::close(fd);
+    return 0;
+}
+#endif
+
+// Tar archives:
+// --tar ARCHIVE prints a digest for each regular file in a tar archive, or
+// in standard input for -, reading it once from start to end without
+// extracting anything. ustar headers, GNU long names and pax path records
+// are understood; other kinds of members are skipped. The reader collects
+// small members into groups of up to 64 MiB, and each group is hashed by
+// the batch engine on another thread while the reader goes on to the next.
+// Members larger than kSmallFile are hashed by the reader as they stream
+// past, so memory use stays bounded.
+struct TarMember
+{
+    std::string name;
+    Message data;               // Contents, if hashed with the group
+    bool hashed = false;        // Hashed by the reader
+    Digest digest = {};
+    Digest512 digest512 = {};
+};
+
+// Reads up to len bytes, stopping early only at the end of the stream.
+// Returns the number of bytes read, or -1 on an error.
+ssize_t readFull(int fd, unsigned char* p, size_t len)
+{
+    size_t done = 0;
+    while (done < len)
+    {
+        const ssize_t n = ::read(fd, p + done, len - done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return -1;
+        if (n == 0)
+            break;
+        done += n;
+    }
+    gThrottle.pace(done);
+    return done;
+}
+
+// Skips len bytes of a stream, seeking in regular files, where a seek past
+// the end would succeed and is checked against the size instead.
+bool skipBytes(int fd, uint64_t len, Message& buffer)
+{
+    if (len == 0)
+        return true;
+    struct stat st = {};
+    if (::fstat(fd, &st) == 0 && S_ISREG(st.st_mode))
+    {
+        const off_t pos = ::lseek(fd, len, SEEK_CUR);
+        return pos >= 0 && pos <= st.st_size;
+    }
+    while (len > 0)
+    {
+        const ssize_t n = readFull(fd, buffer.data(), std::min<uint64_t>(len, buffer.size()));
+        if (n <= 0)
+            return false;
+        len -= n;
+    }
+    return true;
+}
+
+// A numeric header field: octal text, or GNU base 256 if the top bit is set.
+uint64_t tarNumber(const unsigned char* field, size_t len)
+{
+    uint64_t n = 0;
+    if (field[0] & 0x80)
+    {
+        n = field[0] & 0x7f;
+        for (size_t i = 1; i < len; i++)
+            n = (n << 8) | field[i];
+        return n;
+    }
+    size_t i = 0;
+    while (i < len && (field[i] == ' ' || field[i] == 0))
+        i++;
+    for (; i < len && field[i] >= '0' && field[i] <= '7'; i++)
+        n = (n << 3) | (field[i] - '0');
+    return n;
+}
+
+// A header's checksum is the sum of its bytes with the checksum field
+// counted as spaces.
+bool tarChecksumOk(const unsigned char* header)
+{
+    uint64_t sum = 0;
+    for (size_t i = 0; i < 512; i++)
+        sum += (i >= 148 && i < 156) ? ' ' : header[i];
+    return sum == tarNumber(header + 148, 8);
+}
+
+// Hashes the members of a group the reader left to it and prints them all
+// in archive order.
+void hashTarGroup(std::vector<TarMember> group, unsigned threads)
+{
+    std::vector<Span> messages;
+    std::vector<size_t> index;
+    for (size_t i = 0; i < group.size(); i++)
+        if (!group[i].hashed)
+        {
+            messages.emplace_back(group[i].data.data(), group[i].data.size());
+            index.push_back(i);
+        }
+
+    if (gVariant512)
+    {
+        const std::vector<Digest512> digests = hashBatch512(messages, threads);
+        for (size_t k = 0; k < index.size(); k++)
+            group[index[k]].digest512 = digests[k];
+    }
+    else
+    {
+        const std::vector<Digest> digests = hashBatch(messages, threads);
+        for (size_t k = 0; k < index.size(); k++)
+            group[index[k]].digest = digests[k];
+    }
+
+    for (const TarMember& member : group)
+    {
+        if (gVariant512)
+            printDigest512(member.name, member.digest512);
+        else
+            printDigest(member.name, member.digest, false);
+    }
+}
+
+bool hashTar(const std::string& archive, unsigned threads)
+{
+    const int fd = archive == "-" ? STDIN_FILENO : ::open(archive.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        std::cerr << archive << ": " << std::strerror(errno) << std::endl;
+        return false;
+    }
+
+    std::vector<TarMember> group;
+    uint64_t groupBytes = 0;
+    std::thread hashing;
+    auto dispatch = [&] {
+        if (hashing.joinable())
+            hashing.join();
+        hashing = std::thread(hashTarGroup, std::move(group), threads);
+        group.clear();
+        groupBytes = 0;
+    };
+
+    Message buffer(1 << 20);
+    unsigned char header[512];
+    std::string longName, paxPath;
+    const char* error = nullptr;
+    int zeros = 0;              // Zero blocks in a row; two end the archive
+    for (;;)
+    {
+        const ssize_t n = readFull(fd, header, sizeof(header));
+        if (n < 0)
+            error = std::strerror(errno);
+        else if (n < ssize_t(sizeof(header)))
+            error = "truncated archive";
+        if (error)
+            break;
+        if (std::all_of(header, header + sizeof(header), [](unsigned char c) { return c == 0; }))
+        {
+            if (++zeros == 2)
+                break;
+            continue;
+        }
+        zeros = 0;
+        if (!tarChecksumOk(header))
+        {
+            error = "not a tar archive, or a damaged header";
+            break;
+        }
+
+        const uint64_t size = tarNumber(header + 124, 12);
+        const uint64_t padding = (512 - size % 512) % 512;
+        const char type = header[156];
+
+        // A GNU long name or pax extended header describes the next member.
+        if (type == 'L' || type == 'x')
+        {
+            if (size > kSmallFile)
+            {
+                error = "oversized extended header";
+                break;
+            }
+            std::string text(size, '\0');
+            if (readFull(fd, reinterpret_cast<unsigned char*>(text.data()), size) != ssize_t(size)
+                || !skipBytes(fd, padding, buffer))
+            {
+                error = "truncated archive";
+                break;
+            }
+            if (type == 'L')
+                longName = text.c_str();
+            // Records are "<length> <key>=<value>\n".
+            for (size_t pos = 0; type == 'x' && pos < text.size();)
+            {
+                const size_t length = std::strtoul(text.c_str() + pos, nullptr, 10);
+                const size_t space = text.find(' ', pos), equals = text.find('=', pos);
+                if (length == 0 || pos + length > text.size() || space > equals || equals >= pos + length)
+                    break;
+                if (text.compare(space + 1, equals - space - 1, "path") == 0)
+                    paxPath = text.substr(equals + 1, pos + length - equals - 2);
+                pos += length;
+            }
+            continue;
+        }
+
+        // A GNU long link name or a pax global header is of no interest.
+        if (type == 'K' || type == 'g')
+        {
+            if (!skipBytes(fd, size + padding, buffer))
+            {
+                error = "truncated archive";
+                break;
+            }
+            continue;
+        }
+
+        std::string name = reinterpret_cast<const char*>(header);
+        name.resize(strnlen(name.c_str(), 100));
+        if (std::memcmp(header + 257, "ustar", 5) == 0 && header[345])
+            name = std::string(reinterpret_cast<const char*>(header + 345), strnlen(reinterpret_cast<const char*>(header + 345), 155)) + "/" + name;
+        if (!longName.empty())
+            name = longName;
+        if (!paxPath.empty())
+            name = paxPath;
+        longName.clear();
+        paxPath.clear();
+
+        if (type != '0' && type != '\0' && type != '7')
+        {
+            if (!skipBytes(fd, size + padding, buffer))
+            {
+                error = "truncated archive";
+                break;
+            }
+            continue;
+        }
+
+        TarMember member;
+        member.name = std::move(name);
+        bool complete;
+        if (size <= kSmallFile)
+        {
+            member.data.resize(size);
+            complete = readFull(fd, member.data.data(), size) == ssize_t(size);
+        }
+        else
+        {
+            // Too big to hold: hashed here while it streams past.
+            auto stream = [&](auto& hasher) {
+                for (uint64_t left = size; left > 0;)
+                {
+                    const ssize_t got = readFull(fd, buffer.data(), std::min<uint64_t>(left, buffer.size()));
+                    if (got <= 0)
+                        return false;
+                    hasher.update(buffer.data(), got);
+                    left -= got;
+                }
+                return true;
+            };
+            if (gVariant512)
+            {
+                Hasher512 hasher;
+                complete = stream(hasher);
+                member.digest512 = hasher.final();
+            }
+            else
+            {
+                Hasher hasher;
+                complete = stream(hasher);
+                member.digest = hasher.final();
+            }
+            member.hashed = true;
+        }
+        if (!complete || !skipBytes(fd, padding, buffer))
+        {
+            error = "truncated archive";
+            break;
+        }
+
+        groupBytes += size;
+        group.push_back(std::move(member));
+        if (groupBytes >= (64 << 20) || group.size() >= 16384)
+            dispatch();
+    }
+
+    dispatch();
+    hashing.join();
+    if (fd != STDIN_FILENO)
+        ::close(fd);
+    if (error)
+        std::cerr << archive << ": " << error << std::endl;
+    return !error;
+}
+
+#ifdef SHA256_WITH_ZLIB
+// Container layers:
+// An OCI or Docker image layer is addressed by the digest of its compressed
+// blob, while the image config lists its DiffID, the digest of the tar
+// inside. --layer FILE (or - for standard input) reads a .tar.gz blob once
+// and produces both: the reader hashes the compressed bytes and passes each
+// chunk on to a second thread, which inflates it with zlib and hashes the
+// output. Four 1 MiB chunks circulate between the two, so the reader can
+// stay ahead of the slower inflater without holding the whole blob.
+// Concatenated gzip members are inflated one after the other, as gzip does.
+bool hashLayer(const std::string& file, Digest& blob, Digest& diffId)
+{
+    const int fd = file == "-" ? STDIN_FILENO : ::open(file.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        std::cerr << file << ": " << std::strerror(errno) << std::endl;
+        return false;
+    }
+
+    std::mutex mutex;
+    std::condition_variable moved;
+    std::deque<Message> full, empty;
+    bool done = false;
+    for (int i = 0; i < 4; i++)
+        empty.emplace_back(1 << 20);
+
+    std::string error;      // Set by the inflater
+    std::thread inflater([&] {
+        z_stream z = {};
+        inflateInit2(&z, 16 + MAX_WBITS);   // gzip wrapper only
+        Hasher hasher(activeKernel(), variants[0]);
+        Message out(1 << 20);
+        int status = Z_OK;
+        for (;;)
+        {
+            Message chunk;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                moved.wait(lock, [&] { return !full.empty() || done; });
+                if (full.empty())
+                    break;
+                chunk = std::move(full.front());
+                full.pop_front();
+            }
+
+            z.next_in = chunk.data();
+            z.avail_in = chunk.size();
+            while (error.empty() && (z.avail_in > 0 || z.avail_out == 0))
+            {
+                if (status == Z_STREAM_END && z.avail_in > 0)
+                    inflateReset(&z);
+                z.next_out = out.data();
+                z.avail_out = out.size();
+                status = inflate(&z, Z_NO_FLUSH);
+                if (status != Z_OK && status != Z_STREAM_END && status != Z_BUF_ERROR)
+                    error = z.msg ? z.msg : "not a gzip stream";
+                hasher.update(out.data(), out.size() - z.avail_out);
+                if (status == Z_BUF_ERROR)
+                    break;
+            }
+
+            chunk.resize(chunk.capacity());
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                empty.push_back(std::move(chunk));
+            }
+            moved.notify_all();
+        }
+        if (error.empty() && status != Z_STREAM_END)
+            error = "truncated gzip stream";
+        inflateEnd(&z);
+        diffId = hasher.final();
+    });
+
+    Hasher hasher(activeKernel(), variants[0]);
+    int readError = 0;
+    for (ssize_t n = 1 << 20; n == (1 << 20);)
+    {
+        Message chunk;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            moved.wait(lock, [&] { return !empty.empty(); });
+            chunk = std::move(empty.front());
+            empty.pop_front();
+        }
+        n = readFull(fd, chunk.data(), chunk.size());
+        if (n < 0)
+            readError = errno;
+        chunk.resize(std::max<ssize_t>(n, 0));
+        hasher.update(chunk.data(), chunk.size());
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            full.push_back(std::move(chunk));
+        }
+        moved.notify_all();
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        done = true;
+    }
+    moved.notify_all();
+    inflater.join();
+    blob = hasher.final();
+    if (readError)
+        error = std::strerror(readError);
+
+    if (fd != STDIN_FILENO)
+        ::close(fd);
+    if (!error.empty())
+        std::cerr << file << ": " << error << std::endl;
+    return error.empty();
+}
+#endif
+
+// --blocks FILE maps a blk*.dat file and prints the hash of each block
+// followed by the txid and wtxid of each of its transactions.
+bool hashBlockFile(const std::string& file, unsigned threads)
+{
+    const int fd = ::open(file.c_str(), O_RDONLY);
+    struct stat st = {};
+    if (fd < 0 || ::fstat(fd, &st) != 0)
+    {
+        std::cerr << file << ": " << std::strerror(errno) << std::endl;
+        if (fd >= 0)
+            ::close(fd);
+        return false;
+    }
+    void* map = st.st_size > 0 ? ::mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : nullptr;
+    ::close(fd);
+    if (map == MAP_FAILED)
+    {
+        std::cerr << file << ": " << std::strerror(errno) << std::endl;
+        return false;
+    }
+    ::madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+    std::vector<ChainBlock> blocks;
+    std::deque<Message> arena;
+    const bool ok = parseBlockFile(Span(static_cast<const unsigned char*>(map), st.st_size), blocks, arena);
+
+    // Headers, stripped and full transactions, in one batch; a full
+    // serialization is only hashed again if it differs from the stripped one.
+    std::vector<Span> messages;
+    for (const ChainBlock& block : blocks)
+    {
+        messages.push_back(block.header);
+        for (const ChainTx& tx : block.txs)
+        {
+            messages.push_back(tx.stripped);
+            if (tx.full.data() != tx.stripped.data())
+                messages.push_back(tx.full);
+        }
+    }
+    std::vector<Digest> digests;
+    {
+        ExecutionTimer tm;
+        digests = hashBatch256d(messages, threads);
+    }
+
+    size_t k = 0;
+    for (const ChainBlock& block : blocks)
+    {
+        std::cout << "block " << chainHex(digests[k++]) << "\n";
+        for (const ChainTx& tx : block.txs)
+        {
+            const Digest& txid = digests[k++];
+            const Digest& wtxid = tx.full.data() != tx.stripped.data() ? digests[k++] : txid;
+            std::cout << chainHex(txid) << " " << chainHex(wtxid) << "\n";
+        }
+    }
+    std::cout << std::flush;
+
+    if (map)
+        ::munmap(map, st.st_size);
+    if (!ok)
+        std::cerr << file << ": damaged block file, stopped after " << blocks.size() << " blocks" << std::endl;
+    return ok;
+}
+#endif
+
+// Reads all the files into memory and hashes them with hashBatch(), which
+// suits large numbers of small files.
+void hashFilesBatch(const std::vector<std::pair<std::string, bool>>& files, unsigned threads)
+{
+    std::vector<Message> contents(files.size());
+    std::vector<Span> messages(files.size());
+    std::vector<bool> readable(files.size());
+
+    const std::vector<size_t> order = readOrder(files);
+#if defined(__unix__) || defined(__APPLE__)
+    std::vector<std::pair<std::string, bool>> queue;
+    for (const size_t i : order)
+        queue.push_back(files[i]);
+    Prefetcher prefetch(queue, readaheadBudget(), gReadahead > 0);
+#endif
+    for (size_t k = 0; k < files.size(); k++)
+    {
+        const size_t i = order[k];
+#if defined(__unix__) || defined(__APPLE__)
+        // Once read the file is in memory, so the page cache can let it go.
+        const Prefetcher::Claim claim(prefetch, k);
+        const int fd = ::open(files[i].first.c_str(), O_RDONLY);
+        struct stat st = {};
+        size_t len = 0;
+        if (fd >= 0 && ::fstat(fd, &st) == 0)
+        {
+            const SmallFile small = readSmall(fd, st, contents[i], len);
+            if (small != SmallFile::NotSmall)
+            {
+                ::close(fd);
+                readable[i] = small == SmallFile::Read;
+                contents[i].resize(len);
+                messages[i] = Span(contents[i].data(), contents[i].size());
+                continue;
+            }
+        }
+        if (fd >= 0)
+            ::close(fd);
+#endif
+        std::ifstream infile(files[i].first, std::ios::binary);
+        readable[i] = infile.is_open();
+        contents[i].assign(std::istreambuf_iterator<char>(infile), std::istreambuf_iterator<char>());
+        gThrottle.pace(contents[i].size());
+        messages[i] = Span(contents[i].data(), contents[i].size());
+    }
+
+    std::vector<Digest> digests;
+    std::vector<Digest512> digests512;
+    {
+        ExecutionTimer tm;
+        if (gVariant512)
+            digests512 = hashBatch512(messages, threads);
+        else
+            digests = hashBatch(messages, threads);
+    }
+
+    for (size_t i = 0; i < files.size(); i++)
+    {
+        if (!readable[i])
+        {
+            std::cerr << files[i].first << ": cannot read file" << std::endl;
+            continue;
+        }
+        if (gVariant512)
+        {
+            printDigest512(files[i].first, digests512[i]);
+            continue;
+        }
+        const Digest digest = files[i].second ? hashDigest(digests[i]) : digests[i];
+        printDigest(files[i].first, digest, files[i].second);
+    }
+}
+
+// This implementation reads each file to be hashed into memory. This
+// works just fine for small files. Large files should be processed
+// by streaming the data which would change all the code above. In
+// practice, one would use a library function or utility like sha2
+// to calculate the hash/digest of a file. This is just an educational
+// example for acedemic purposes only.
+#ifndef SHA256_FUZZER
+int main(const int argc, char* argv[])
+{
+    try {
+        const std::vector<std::string> args = arguments(argc, argv);
+        loadProfile();
+
+        if (argc == 1) {
+            std::cout << "SHA-256 algorithm for educational purposes only!\n"
+                      << "$ sha256 [options] [-] file1 [file2 ...]\n\n"
+                      << "Reads each file and provides a SHA-256 digest.\n"
+                      << "The - argument can appear anywhere in the argument\n"
+                      << "list. Files appearing after the - will be double hashed.\n"
+                      << "Bitcoin does this sha256(sha256(data)).\n"
+                      << "The output is a text hex representation of the "
+                      << "SHA-256 message digest.\n\n"
+                      << "  -a NAME        algorithm: sha256 (the default), sha224,\n"
+                      << "                 sha512, sha384 or sha512/256\n"
+                      << "  --crc32c       also print a CRC-32C of each file, from the same reads\n"
+                      << "  --xxh64        also print an XXH64 of each file, from the same reads\n"
+                      << "  --async        hash all files concurrently on one event loop thread\n"
+                      << "  -j N           hash files on N threads (0 uses the tuned count)\n"
+                      << "  --batch        read all files into memory and hash them as one batch,\n"
+                      << "                 short ones on the multi-buffer kernel\n"
+                      << "  --physical-order  read files in the order they lie on disk (implies\n"
+                      << "                 -j 1 without -j or --batch)\n"
+                      << "  --cached-first  hash the files already in the page cache first while\n"
+                      << "                 the others are read ahead (implies -j 1 without -j\n"
+                      << "                 or --batch)\n"
+                      << "  --readahead N  announce upcoming files to the kernel up to N bytes\n"
+                      << "                 (K, M, G suffixes) ahead and drop finished ones from\n"
+                      << "                 the page cache\n"
+                      << "  -r             hash the files below directory arguments\n"
+                      << "  --tree         print one digest for each directory argument, over\n"
+                      << "                 the names, modes and contents of everything below it\n"
+                      << "  --watch        hash the files below each directory argument, then keep\n"
+                      << "                 running and rehash the files that change (Linux)\n"
+                      << "  --tar ARCHIVE  print a digest for each file in a tar archive, or in\n"
+                      << "                 standard input for -, without extracting it\n"
+                      << "  --layer FILE   print the blob digest and DiffID of a .tar.gz image\n"
+                      << "                 layer, or of standard input for - (needs zlib)\n"
+                      << "  --blocks FILE  print the block hashes, txids and wtxids in a Bitcoin\n"
+                      << "                 blk*.dat file\n"
+                      << "  --journal FILE  append each file's digest to FILE as it is hashed\n"
+                      << "                 (implies -j 0 without -j)\n"
+                      << "  --resume       with --journal, skip the files the journal already has\n"
+                      << "                 unchanged and report its digests for them\n"
+                      << "  --max-rate N   read at most N bytes per second (K, M, G suffixes)\n"
+                      << "  --duty P       keep each thread busy at most P percent of the time\n"
+                      << "  --idle         use the idle I/O and CPU scheduling classes (Linux)\n"
+                      << "  --kernel NAME  use a specific kernel:";
+            for (const auto& k : kernels())
+                std::cout << " " << k.name;
+            std::cout << "\n"
+                      << "  --bench        compare the throughput of the kernels\n"
+                      << "  --bench-readahead  read and hash the files from a cold cache\n"
+                      << "                 without and with readahead\n"
+                      << "  --selftest     check every kernel against the reference code and\n"
+                      << "                 the NIST known answers\n"
+                      << "  --tune         benchmark this host and save a profile to " << profilePath() << "\n";
+            return 0;
+        }
+
+        bool async = false;
+        bool batch = false;
+        bool benchReadahead = false;
+        bool bench = false;         // --bench, --selftest and --tune run after
+        bool runSelftest = false;   // every option is parsed
+        bool runTune = false;
+        bool recursive = false;
+        bool tree = false;
+        bool watch = false;
+        std::vector<std::string> archives;
+        std::vector<std::string> layers;
+        std::vector<std::string> blockFiles;
+        bool resume = false;
+        std::string journal;
+        int jobs = -1;
+        std::vector<std::pair<std::string, bool>> files;
+
+        bool doublehash = false;
+        for (size_t i = 0; i < args.size(); i++)
+        {
+            const std::string& arg = args[i];
+            if (arg == "-")
+            {
+                doublehash = true;
+                continue;
+            }
+            if (arg == "--async")
+            {
+                async = true;
+                continue;
+            }
+            if (arg == "-a" && i + 1 < args.size())
+            {
+                if (!selectVariant(args[++i]))
+                {
+                    std::cerr << args[i] << ": unknown algorithm" << std::endl;
+                    return 1;
+                }
+                continue;
+            }
+            if (arg == "--crc32c")
+            {
+                gChecksums.crc32c.emplace();
+                continue;
+            }
+            if (arg == "--xxh64")
+            {
+                gChecksums.xxh64.emplace();
+                continue;
+            }
+            if (arg == "--batch")
+            {
+                batch = true;
+                continue;
+            }
+            if (arg == "-j" && i + 1 < args.size())
+            {
+                jobs = std::stoi(args[++i]);
+                continue;
+            }
+            if (arg == "--cached-first")
+            {
+                gCachedFirst = true;
+                continue;
+            }
+            if (arg == "--physical-order")
+            {
+                gPhysicalOrder = true;
+                continue;
+            }
+            if (arg == "--readahead" && i + 1 < args.size())
+            {
+                gReadahead = parseBytes(args[++i]);
+                continue;
+            }
+            if (arg == "-r")
+            {
+                recursive = true;
+                continue;
+            }
+            if (arg == "--tree")
+            {
+                tree = true;
+                continue;
+            }
+            if (arg == "--watch")
+            {
+                watch = true;
+                continue;
+            }
+            if (arg == "--tar" && i + 1 < args.size())
+            {
+                archives.push_back(args[++i]);
+                continue;
+            }
+            if (arg == "--blocks" && i + 1 < args.size())
+            {
+                blockFiles.push_back(args[++i]);
+                continue;
+            }
+            if (arg == "--layer" && i + 1 < args.size())
+            {
+                layers.push_back(args[++i]);
+                continue;
+            }
+            if (arg == "--journal" && i + 1 < args.size())
+            {
+                journal = args[++i];
+                continue;
+            }
+            if (arg == "--resume")
+            {
+                resume = true;
+                continue;
+            }
+            if (arg == "--max-rate" && i + 1 < args.size())
+            {
+                gThrottle.setRate(parseBytes(args[++i]));
+                continue;
+            }
+            if (arg == "--duty" && i + 1 < args.size())
+            {
+                gThrottle.setDuty(std::stoi(args[++i]));
+                continue;
+            }
+            if (arg == "--idle")
+            {
+                if (!setIdlePriority())
+                    std::cerr << "--idle: cannot lower the scheduling priority" << std::endl;
+                continue;
+            }
+            if (arg == "--bench-readahead")
+            {
+                benchReadahead = true;
+                continue;
+            }
+            if (arg == "--bench")
+            {
+                bench = true;
+                continue;
+            }
+            if (arg == "--selftest")
+            {
+                runSelftest = true;
+                continue;
+            }
+            if (arg == "--tune")
+            {
+                runTune = true;
+                continue;
+            }
+            if (arg == "--kernel" && i + 1 < args.size())
+            {
+                if (!selectKernel(args[++i]))
+                {
+                    std::cerr << args[i] << ": unknown or unsupported kernel, or one that only hashes batches" << std::endl;
+                    return 1;
+                }
+                continue;
+            }
+            files.emplace_back(arg, doublehash);
+        }
+
+        if (runSelftest)
+            return selftest();
+        if (bench)
+        {
+            benchmark();
+            return 0;
+        }
+        if (runTune)
+        {
+            tune();
+            return 0;
+        }
+
+        // Double hashing is Bitcoin's and hashDigest() only does SHA-256.
+        if (doublehash && (gVariant512 || &activeVariant() != &variants[0]))
+        {
+            std::cerr << "- (double hashing) is only supported for sha256" << std::endl;
+            return 1;
+        }
+
+        if ((async || batch) && gChecksums.any())
+        {
+            std::cerr << "--crc32c and --xxh64 are not supported with --async or --batch" << std::endl;
+            return 1;
+        }
+
+        if (tree && (gVariant512 || doublehash || async || batch || recursive))
+        {
+            std::cerr << "--tree only supports sha256 and sha224, without -, --async, --batch or -r" << std::endl;
+            return 1;
+        }
+        if (watch && (async || batch || tree || recursive))
+        {
+            std::cerr << "--watch is not supported with --async, --batch, --tree or -r" << std::endl;
+            return 1;
+        }
+        if (!blockFiles.empty() && (!files.empty() || !archives.empty() || !layers.empty() || tree || watch
+                                    || async || batch || gVariant512 || &activeVariant() != &variants[0]))
+        {
+            std::cerr << "--blocks is sha256 only, and cannot be combined with file arguments, --tar,\n"
+                      << "--layer, --tree, --watch, --async or --batch" << std::endl;
+            return 1;
+        }
+        if (!layers.empty() && (!files.empty() || !archives.empty() || tree || watch || async || batch))
+        {
+            std::cerr << "--layer cannot be combined with file arguments, --tar, --tree, --watch,\n"
+                      << "--async or --batch" << std::endl;
+            return 1;
+        }
+        if (!archives.empty() && (!files.empty() || doublehash || async || batch || tree || watch
+                                  || gChecksums.any() || !journal.empty()))
+        {
+            std::cerr << "--tar cannot be combined with file arguments, -, --async, --batch, --tree, --watch,\n"
+                      << "--crc32c, --xxh64 or --journal" << std::endl;
+            return 1;
+        }
+        if (recursive)
+            files = expandDirectories(files);
+
+        if (resume && journal.empty())
+        {
+            std::cerr << "--resume needs --journal" << std::endl;
+            return 1;
+        }
+        if (!journal.empty() && (async || batch || gChecksums.any()))
+        {
+            std::cerr << "--journal is not supported with --async, --batch, --crc32c or --xxh64" << std::endl;
+            return 1;
+        }
+        if (!journal.empty() && !gJournal.open(journal, resume))
+        {
+            std::cerr << journal << ": " << std::strerror(errno) << std::endl;
+            return 1;
+        }
+
+        if (async && gThrottle.active())
+        {
+            std::cerr << "--max-rate and --duty are not supported with --async" << std::endl;
+            return 1;
+        }
+        const Throttle::Report report(gThrottle);
+
+        if (batch)
+        {
+            hashFilesBatch(files, jobs > 0 ? jobs : tunedThreads());
+            return 0;
+        }
+
+#if defined(__unix__) || defined(__APPLE__)
+        if (async && gVariant512)
+        {
+            std::cerr << "--async only supports the SHA-256 family" << std::endl;
+            return 1;
+        }
+        if (async)
+        {
+            hashFilesAsync(files);
+            return 0;
+        }
+
+        if (tree)
+        {
+            bool ok = true;
+            for (const auto& dir : files)
+            {
+                Digest digest;
+                if (!hashTree(dir.first, jobs > 0 ? jobs : tunedThreads(), digest))
+                {
+                    ok = false;
+                    continue;
+                }
+                std::cout << activeVariant().label << " tree (" << dir.first << ") = "
+                          << toHex(digest, activeVariant().words) << std::endl;
+            }
+            return ok ? 0 : 1;
+        }
+
+        if (!blockFiles.empty())
+        {
+            bool ok = true;
+            for (const auto& file : blockFiles)
+                ok = hashBlockFile(file, jobs > 0 ? jobs : tunedThreads()) && ok;
+            return ok ? 0 : 1;
+        }
+
+        if (!layers.empty())
+        {
+#ifdef SHA256_WITH_ZLIB
+            ExecutionTimer tm;
+            bool ok = true;
+            for (const auto& layer : layers)
+            {
+                Digest blob, diffId;
+                if (!hashLayer(layer, blob, diffId))
+                {
+                    ok = false;
+                    continue;
+                }
+                std::cout << "Blob   (" << layer << ") = sha256:" << toHex(blob) << "\n"
+                          << "DiffID (" << layer << ") = sha256:" << toHex(diffId) << std::endl;
+            }
+            return ok ? 0 : 1;
+#else
+            std::cerr << "--layer needs a build with zlib, see the README" << std::endl;
+            return 1;
+#endif
+        }
+
+        if (!archives.empty())
+        {
+            ExecutionTimer tm;
+            bool ok = true;
+            for (const auto& archive : archives)
+                ok = hashTar(archive, jobs > 0 ? jobs : tunedThreads()) && ok;
+            return ok ? 0 : 1;
+        }
+
+        if (watch)
+        {
+#if defined(__linux__)
+            return watchTrees(files, jobs > 0 ? jobs : tunedThreads());
+#else
+            std::cerr << "--watch is only supported on Linux" << std::endl;
+            return 1;
+#endif
+        }
+
+        if (benchReadahead)
+        {
+            benchmarkReadahead(files);
+            return 0;
+        }
+
+        // Only the pool can report in a different order than it reads.
+        if ((gPhysicalOrder || gCachedFirst) && jobs < 0)
+            jobs = 1;
+        // Only the pool keeps a journal.
+        if (gJournal.enabled() && jobs < 0)
+            jobs = 0;
+
+        if (jobs >= 0)
+        {
+            hashFilesParallel(files, jobs > 0 ? jobs : tunedThreads());
+            return 0;
+        }
+#endif
+
+        Message msg = {}, stream;
+        msg.reserve(1024);
+
+#if defined(__unix__) || defined(__APPLE__)
+        Prefetcher prefetch(files, gReadahead);
+#endif
+        for (size_t n = 0; n < files.size(); n++)
+        {
+            const auto& [file, doublehash] = files[n];
+            size_t fileSize = 0;
+            bool loaded = false;
+#if defined(__unix__) || defined(__APPLE__)
+            const Prefetcher::Claim claim(prefetch, n);
+            const int fd = ::open(file.c_str(), O_RDONLY);
+            if (fd < 0)
+            {
+                std::cerr << file << ": " << std::strerror(errno) << std::endl;
+                continue;
+            }
+            struct stat st = {};
+            if (::fstat(fd, &st) != 0)
+            {
+                std::cerr << file << ": " << std::strerror(errno) << std::endl;
+                ::close(fd);
+                continue;
+            }
+            const bool offload = kernelFor(st.st_size).hashFd && !gVariant512 && !gChecksums.any()
+                                 && !gThrottle.active();
+
+            // Small files are read with a single pread() into msg, whose
+            // memory is kept from one file to the next.
+            if (!offload)
+            {
+                const SmallFile small = readSmall(fd, st, msg, fileSize);
+                if (small == SmallFile::Failed)
+                {
+                    std::cerr << file << ": " << std::strerror(errno) << std::endl;
+                    ::close(fd);
+                    continue;
+                }
+                loaded = small == SmallFile::Read;
+            }
+
+            // Anything else is streamed through one buffer from the same
+            // descriptor: sparse files without reading their holes, and
+            // offload kernels read the file themselves.
+            if (!loaded)
+            {
+                ExecutionTimer tm;
+                stream.resize(1 << 20);
+                FileResult result = hashFile(file, fd, st, stream);
+                ::close(fd);
+                if (!result.error.empty())
+                    std::cerr << result.error << std::endl;
+                else if (gVariant512)
+                    printDigest512(file, result.digest512);
+                else
+                    printDigest(file, doublehash ? hashDigest(result.digest) : result.digest, doublehash);
+                if (result.error.empty())
+                    result.sums.print(file);
+                continue;
+            }
+            ::close(fd);
+#endif
+
+            if (!loaded)
+            {
+                std::ifstream infile(file, std::ios::binary);
+                infile.seekg(0, std::ios::end);
+                fileSize = infile.tellg();
+
+                msg.resize(fileSize);
+
+                // Seek back to the beginning of the file
+                infile.seekg(0, std::ios::beg);
+
+                // Read the entire file into the vector
+                infile.read(reinterpret_cast<char*>(msg.data()), fileSize);
+                gThrottle.pace(fileSize);
+
+                infile.close();
+            }
+
+            const Kernel& kernel = kernelFor(fileSize);
+            Checksums sums = gChecksums;
+            if (gVariant512)
+            {
+                ExecutionTimer tm;
+                Hasher512 hasher;
+                feed(hasher, sums, msg.data(), fileSize);
+                printDigest512(file, hasher.final());
+            }
+            else
+            {
+                ExecutionTimer tm;
+                Hasher hasher(kernel);
+                feed(hasher, sums, msg.data(), fileSize);
+                Digest digest = hasher.final();
+
+                if (doublehash)
+                    digest = hashDigest(digest);
+
+                printDigest(file, digest, doublehash);
+            }
+            sums.print(file);
+
+            // Large files' memory is not kept.
+            if (!loaded)
+                msg = {};
+        }
+    }
+    // Honestly if we catch an error, there is a bug somewhere in the
+    // code that I have not caught. Pun intended.
+    catch (std::out_of_range) {
+        std::cerr << "range error" << std::endl;
+    }
+    catch (...) {
+        std::cerr << "unknown exception thrown" << std::endl;
+    }
+
+    return 0;
+}
+#endif
+